@@ -0,0 +1,103 @@
+#!/usr/bin/python
+
+#Benchmark for simpleRefactor: generates a synthetic tree (see gentree.py), refactors it (exporting the edits, so the tree can be reused),
+#and records wall time, time per phase and peak RSS in a JSON file. If a baseline is given, regressions against it are reported, and the
+#exit code is non-zero
+
+import argparse
+import json
+import os
+import resource
+import subprocess as subp
+import sys
+import time
+
+import gentree
+
+#time of each phase, as reported by --stats
+PHASES = ['parse', 'match', 'classify', 'rewrite', 'write']
+#metrics compared against the baseline: lower is better for all of them
+METRICS = ['wall_s', 'peak_rss_kb']+['%s_ms' % phase for phase in PHASES]
+
+def runOnce(args, files):
+    root = os.path.abspath(args.workdir)
+    statsPath = os.path.join(root, 'stats.json')
+    commandline = [args.tool, '-p', root, '--terms-file=%s' % os.path.join(root, 'terms.txt'), '--export-edits=%s' % os.path.join(root, 'edits.yaml'),
+                   '--stats=%s' % statsPath, '-j', str(args.jobs)]+files
+    start = time.time()
+    proc = subp.Popen(commandline, stdout=subp.PIPE, stderr=subp.PIPE)
+    out, err = proc.communicate()
+    wall = time.time()-start
+    if proc.returncode!=0:
+        sys.stderr.write(err)
+        raise RuntimeError("Error in command <%s>" % ' '.join(commandline))
+    with open(statsPath, 'r') as f:
+        summary = json.load(f)['summary']
+    record = {'wall_s': wall, 'matches': summary['matches'], 'edits': sum(summary['edits'].values())}
+    for phase in PHASES:
+        record['%s_ms' % phase] = summary['ms'][phase]
+    return record
+
+def run(args):
+    args.outdir = args.workdir
+    files = gentree.Generator(args).run()
+    results = []
+    for i in xrange(args.repeat):
+        results.append(runOnce(args, files))
+    #the least noisy measure of the time is the fastest run
+    record = dict((key, min(r[key] for r in results)) for key in results[0])
+    #maximum over all the child processes so far, in KB on Linux
+    record['peak_rss_kb'] = resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss
+    record['tree'] = dict((key, getattr(args, key)) for key in ['tus', 'functions', 'header_depth', 'header_functions', 'calls_per_function', 'branch_lines', 'nesting', 'template_instantiations', 'terms', 'seed'])
+    record['jobs'] = args.jobs
+    return record
+
+def compare(record, baseline, tolerance):
+    regressions = []
+    if baseline.get('tree')!=record['tree'] or baseline.get('jobs')!=record['jobs']:
+        print "WARNING: the baseline was measured with a different tree or number of jobs, not comparing"
+        return regressions
+    for counter in ['matches', 'edits']:
+        if baseline.get(counter) is not None and baseline[counter]!=record[counter]:
+            print "WARNING: %d %s now, %d in the baseline" % (record[counter], counter, baseline[counter])
+    for metric in METRICS:
+        old, new = baseline.get(metric), record.get(metric)
+        if old is None or new is None or old<=0:
+            continue
+        change = (new-old)/float(old)
+        print "%-12s baseline %12.3f  now %12.3f  (%+.1f%%)" % (metric, old, new, change*100)
+        if change>tolerance:
+            regressions.append(metric)
+    return regressions
+
+if __name__=='__main__':
+    parser = argparse.ArgumentParser(description='benchmark simpleRefactor on a synthetic tree')
+    parser.add_argument('--tool', default='./simpleRefactor', help='simpleRefactor binary')
+    parser.add_argument('--workdir', default='bench-tree', help='directory for the generated tree')
+    parser.add_argument('--output', default='bench-results.json', help='where to write the results of this run')
+    parser.add_argument('--baseline', default=None, help='results of a previous run to compare against')
+    parser.add_argument('--update-baseline', action='store_true', help='write the results of this run to the baseline instead of comparing')
+    parser.add_argument('--tolerance', type=float, default=0.15, help='relative increase of a metric reported as a regression')
+    parser.add_argument('--repeat', type=int, default=3, help='number of runs (the fastest one is recorded)')
+    parser.add_argument('-j', '--jobs', type=int, default=1, help='-j for simpleRefactor')
+    gentree.addArguments(parser)
+    args = parser.parse_args()
+
+    record = run(args)
+    with open(args.output, 'w') as f:
+        json.dump(record, f, indent=2, sort_keys=True)
+    print "Results written to %s" % args.output
+    if args.baseline is None:
+        sys.exit(0)
+    if args.update_baseline or not os.path.isfile(args.baseline):
+        with open(args.baseline, 'w') as f:
+            json.dump(record, f, indent=2, sort_keys=True)
+        print "Baseline written to %s" % args.baseline
+        sys.exit(0)
+    with open(args.baseline, 'r') as f:
+        baseline = json.load(f)
+    regressions = compare(record, baseline, args.tolerance)
+    if len(regressions)>0:
+        print "REGRESSION in %s (more than %d%% over the baseline)" % (', '.join(regressions), int(args.tolerance*100))
+        sys.exit(1)
+    print "No regressions against the baseline"
@@ -0,0 +1,119 @@
+//------------------------------------------------------------------------------
+// Micro-benchmark for the way RefactorEngine builds source locations while
+// reindenting a branch: the old round-trip through line/column numbers
+// (getLineNumber/getColumnNumber/translateFileLineCol) vs. the start location
+// of the FileID plus an offset, with a per-file table of line offsets.
+//
+// usage: benchLocations [lines in the branch] [other files in the TU]
+//------------------------------------------------------------------------------
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/Basic/FileManager.h"
+#include "clang/Basic/FileSystemOptions.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace clang;
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now()-start).count();
+}
+
+static std::string syntheticBranch(unsigned numLines) {
+    std::string text = "void functionDeclaredInHeader() {\n     if (configVariable(\"UseSpanishLanguage\",3,4)) {\n";
+    for (unsigned i = 0; i < numLines; ++i) {
+        text += "             printf(\"UNO\");\n";
+    }
+    text += "     }\n}\n";
+    return text;
+}
+
+static FileID addVirtualFile(FileManager &Files, SourceManager &SM, StringRef name, StringRef contents) {
+    const FileEntry *entry = Files.getVirtualFile(name, contents.size(), 0);
+    SM.overrideFileContents(entry, llvm::MemoryBuffer::getMemBufferCopy(contents, name));
+    return SM.createFileID(entry, SourceLocation(), SrcMgr::C_User);
+}
+
+int main(int argc, const char **argv) {
+    unsigned numLines = argc>1 ? atoi(argv[1]) : 20000;
+    unsigned numFiles = argc>2 ? atoi(argv[2]) : 2000;
+
+    IntrusiveRefCntPtr<DiagnosticIDs> DiagID(new DiagnosticIDs());
+    IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts(new DiagnosticOptions());
+    DiagnosticsEngine Diags(DiagID, &*DiagOpts, new IgnoringDiagConsumer());
+    FileSystemOptions FSOpts;
+    FileManager Files(FSOpts);
+    SourceManager SM(Diags, Files);
+
+    //translateFileLineCol() has to look up the FileID of the header, so the benchmark has as many files in the TU as requested
+    SM.setMainFileID(addVirtualFile(Files, SM, "main.cpp", "#include \"test.hpp\"\n"));
+    for (unsigned i = 0; i < numFiles; ++i) {
+        addVirtualFile(Files, SM, "header" + std::to_string(i) + ".hpp", "int x;\n");
+    }
+    std::string text = syntheticBranch(numLines);
+    FileID FID = addVirtualFile(Files, SM, "test.hpp", text);
+    const FileEntry *entry = SM.getFileEntryForID(FID);
+    StringRef buffer = SM.getBufferData(FID);
+
+    //reindentBranch() composes one location per line, just before the end of the indentation
+    std::vector<unsigned> offsets;
+    size_t pos = 0;
+    while (pos < buffer.size()) {
+        size_t indentEnd = buffer.find_first_not_of(' ', pos);
+        if (indentEnd!=StringRef::npos && indentEnd>pos) {
+            offsets.push_back(indentEnd-1);
+        }
+        size_t eol = buffer.find('\n', pos);
+        if (eol==StringRef::npos) break;
+        pos = eol+1;
+    }
+
+    std::vector<SourceLocation> oldLocs, newLocs;
+    std::vector<unsigned> oldLines, newLines;
+    oldLocs.reserve(offsets.size());
+    newLocs.reserve(offsets.size());
+
+    Clock::time_point start = Clock::now();
+    for (unsigned offset : offsets) {
+        unsigned line = SM.getLineNumber(FID, offset);
+        unsigned column = SM.getColumnNumber(FID, offset);
+        oldLocs.push_back(SM.translateFileLineCol(entry, line, column));
+        oldLines.push_back(SM.getLineNumber(FID, SM.getFileOffset(oldLocs.back())));
+    }
+    double oldMs = elapsedMs(start);
+
+    start = Clock::now();
+    SourceLocation fileStart = SM.getLocForStartOfFile(FID);
+    std::vector<unsigned> lineOffsets(1, 0);
+    for (unsigned i = 0; i < buffer.size(); ++i) {
+        if (buffer[i]=='\n') lineOffsets.push_back(i+1);
+    }
+    for (unsigned offset : offsets) {
+        newLocs.push_back(fileStart.getLocWithOffset(offset));
+        newLines.push_back(std::upper_bound(lineOffsets.begin(), lineOffsets.end(), SM.getFileOffset(newLocs.back())) - lineOffsets.begin());
+    }
+    double newMs = elapsedMs(start);
+
+    unsigned mismatches = 0;
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (oldLocs[i]!=newLocs[i] || oldLines[i]!=newLines[i]) ++mismatches;
+    }
+
+    llvm::outs() << "branch lines: " << numLines << ", other files in the TU: " << numFiles << "\n";
+    llvm::outs() << "line/column round-trip:  " << oldMs << " ms\n";
+    llvm::outs() << "file start plus offset:  " << newMs << " ms (" << (newMs>0 ? oldMs/newMs : 0) << "x)\n";
+    if (mismatches>0) {
+        llvm::outs() << "ERROR: " << mismatches << " locations differ!\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+#!/usr/bin/python
+
+#Checks GrokScraper against a local stub of OpenGrok (search results, history pages and annotated sources): the revisions of all the lines
+#found must be the expected ones, each annotated file must be downloaded just once, never with more concurrent requests than workers, and
+#a second scraper sharing the cache directory must only download the files that changed in between. This is checked twice: with ETags in
+#the annotated sources (the cache revalidates them), and without them (the cache is keyed by the latest revision in the history pages)
+
+import BaseHTTPServer
+import SocketServer
+import argparse
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import time
+import urlparse
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import grokscrap
+
+TERM = 'UseSpanishLanguage'
+
+class StubGrok:
+    def __init__(self, numFiles, numLines, delay, etags):
+        self.numFiles = numFiles
+        self.numLines = numLines
+        self.delay = delay
+        self.etags = etags
+        self.lock = threading.Lock()
+        #bumped to simulate a new revision of a file
+        self.versions = dict((self.path(i), 0) for i in xrange(numFiles))
+        self.downloads = dict()
+        self.notModified = 0
+        self.inFlight = 0
+        self.maxInFlight = 0
+
+    def path(self, i):
+        return '/source/xref/proj/file%d.cpp' % i
+
+    def historyPath(self, path):
+        return path.replace('/xref/', '/history/', 1)
+
+    #the term is in every 7th line of each file
+    def lines(self):
+        return range(3, self.numLines, 7)
+
+    def revision(self, path, line):
+        return 'r%d_%d' % (self.versions[path], (line*31+len(path))%5)
+
+    def search(self):
+        results = []
+        for i in xrange(self.numFiles):
+            for line in self.lines():
+                results.append('<tt><a href="%s#%d"><b>%s</b></a></tt>' % (self.path(i), line, TERM))
+        return '<html><body>%s</body></html>' % ''.join(results)
+
+    def annotated(self, path):
+        lines = []
+        for line in xrange(1, self.numLines+1):
+            #OpenGrok highlights some lines with a different class
+            cls = 'hl' if line%10==0 else 'l'
+            rev = self.revision(path, line)
+            lines.append('<a class="%s" name="%d" href="#%d">%d</a><span class="blame"><a class="r" title="comment for %s" href="/history/%s">%s</a></span>code\n'
+                         % (cls, line, line, line, rev, rev, rev))
+        return '<html><body><pre>%s</pre></body></html>' % ''.join(lines)
+
+    #newest revision first
+    def history(self, path):
+        rows = ['<tr><td><a href="%s?r=v%d">v%d</a></td><td>comment</td></tr>' % (path, v, v) for v in xrange(self.versions[path], -1, -1)]
+        return '<html><body><table id="revisions">%s</table></body></html>' % ''.join(rows)
+
+    def handle(self, handler):
+        with self.lock:
+            self.inFlight += 1
+            self.maxInFlight = max(self.maxInFlight, self.inFlight)
+        try:
+            time.sleep(self.delay)
+            url = urlparse.urlparse(handler.path)
+            if url.path=='/source/search':
+                return 200, {}, self.search()
+            if url.path in self.versions:
+                etag = '"%s-%d"' % (url.path, self.versions[url.path])
+                headers = {'ETag': etag} if self.etags else {}
+                if self.etags and handler.headers.get('If-None-Match')==etag:
+                    with self.lock:
+                        self.notModified += 1
+                    return 304, headers, ''
+                with self.lock:
+                    self.downloads[url.path] = self.downloads.get(url.path, 0)+1
+                return 200, headers, self.annotated(url.path)
+            for path in self.versions:
+                if url.path==self.historyPath(path):
+                    return 200, {}, self.history(path)
+            return 404, {}, 'not found'
+        finally:
+            with self.lock:
+                self.inFlight -= 1
+
+class Server(SocketServer.ThreadingMixIn, BaseHTTPServer.HTTPServer):
+    daemon_threads = True
+
+def makeHandler(stub):
+    class Handler(BaseHTTPServer.BaseHTTPRequestHandler):
+        protocol_version = 'HTTP/1.1'
+
+        def do_GET(self):
+            status, headers, body = stub.handle(self)
+            self.send_response(status)
+            for name, value in headers.iteritems():
+                self.send_header(name, value)
+            self.send_header('Content-Type', 'text/html')
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format, *args):
+            pass
+    return Handler
+
+def expectedRevisions(stub, table):
+    return set(stub.revision(f, line) for f, lines in table.iteritems() for line in lines)
+
+#the errors found with a stub with or without ETags
+def check(args, etags):
+    stub = StubGrok(args.files, args.lines, args.delay, etags)
+    server = Server(('127.0.0.1', 0), makeHandler(stub))
+    thread = threading.Thread(target=server.serve_forever)
+    thread.daemon = True
+    thread.start()
+    cachedir = tempfile.mkdtemp(prefix='grokcache')
+    errors = []
+    mode = 'with ETags' if etags else 'without ETags'
+    try:
+        def scraper():
+            return grokscrap.GrokScraper(url='http://127.0.0.1:%d' % server.server_address[1], domain='source', proj='proj', path='', nresults=100000,
+                                         errors='raise', workers=args.workers, cachedir=cachedir)
+
+        table = scraper().getOcurrencesForTerms([TERM])
+        if sorted(table.keys())!=sorted(stub.versions.keys()) or any(sorted(lines)!=stub.lines() for lines in table.itervalues()):
+            errors.append('wrong ocurrences')
+
+        start = time.time()
+        revisions = scraper().getRevisions(table)
+        print "%s, first run: %.2f s, %d downloads" % (mode, time.time()-start, sum(stub.downloads.values()))
+        if set(revisions.keys())!=expectedRevisions(stub, table):
+            errors.append('wrong revisions in the first run')
+        if any(comment!='comment for %s' % rev for rev, comment in revisions.iteritems()):
+            errors.append('wrong comments in the first run')
+        if any(n!=1 for n in stub.downloads.itervalues()) or len(stub.downloads)!=args.files:
+            errors.append('each annotated file should be downloaded once in the first run')
+        if stub.maxInFlight>args.workers:
+            errors.append('%d concurrent requests with %d workers' % (stub.maxInFlight, args.workers))
+        if args.workers>1 and stub.maxInFlight<2:
+            errors.append('the annotated files were not downloaded concurrently')
+
+        #a new revision of one of the files: it is the only one downloaded again
+        changed = stub.path(0)
+        stub.versions[changed] += 1
+        stub.downloads.clear()
+        start = time.time()
+        revisions = scraper().getRevisions(table)
+        print "%s, second run: %.2f s, %d downloads, %d not modified" % (mode, time.time()-start, sum(stub.downloads.values()), stub.notModified)
+        if set(revisions.keys())!=expectedRevisions(stub, table):
+            errors.append('wrong revisions in the second run')
+        if stub.downloads!={changed: 1} or stub.notModified!=(args.files-1 if etags else 0):
+            errors.append('only the changed file should be downloaded in the second run')
+    finally:
+        server.shutdown()
+        shutil.rmtree(cachedir)
+    return ['%s: %s' % (mode, error) for error in errors]
+
+if __name__=='__main__':
+    parser = argparse.ArgumentParser(description='check GrokScraper against a local stub of OpenGrok')
+    parser.add_argument('--files', type=int, default=40, help='number of files with ocurrences')
+    parser.add_argument('--lines', type=int, default=300, help='lines in each file')
+    parser.add_argument('--workers', type=int, default=4, help='concurrent requests of the scraper')
+    parser.add_argument('--delay', type=float, default=0.02, help='seconds the stub takes to answer each request')
+    args = parser.parse_args()
+
+    errors = check(args, True)+check(args, False)
+    for error in errors:
+        print "ERROR: %s" % error
+    if len(errors)>0:
+        sys.exit(1)
+    print "GrokScraper OK"
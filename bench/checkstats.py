@@ -0,0 +1,29 @@
+#!/usr/bin/python
+
+#Checks the summary of a --stats file: the number of matched call sites must be the expected one (so call sites reached several times,
+#for example from the instantiations of a template, are counted just once), and optionally the time spent matching must be under a limit
+
+import argparse
+import json
+import sys
+
+if __name__=='__main__':
+    parser = argparse.ArgumentParser(description='check the summary of a simpleRefactor --stats file')
+    parser.add_argument('stats', help='file written by --stats')
+    parser.add_argument('--matches', type=int, required=True, help='expected number of matched call sites')
+    parser.add_argument('--max-match-ms', type=float, default=None, help='maximum time spent matching, in milliseconds (not checked by default: wall time depends on the machine)')
+    args = parser.parse_args()
+
+    with open(args.stats, 'r') as f:
+        summary = json.load(f)['summary']
+    errors = []
+    if summary['matches']!=args.matches:
+        errors.append('%d call sites matched, expected %d' % (summary['matches'], args.matches))
+    if summary['duplicates']>0:
+        errors.append('%d call sites reached more than once' % summary['duplicates'])
+    if args.max_match_ms is not None and summary['ms']['match']>args.max_match_ms:
+        errors.append('%.3f ms spent matching, the limit is %.3f ms' % (summary['ms']['match'], args.max_match_ms))
+    print "%d call sites matched in %.3f ms" % (summary['matches'], summary['ms']['match'])
+    for error in errors:
+        print "ERROR: %s" % error
+    sys.exit(1 if len(errors)>0 else 0)
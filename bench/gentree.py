@@ -0,0 +1,129 @@
+#!/usr/bin/python
+
+#Generator of synthetic code bases for benchmarking simpleRefactor: a chain of headers (each one including the next one) and a set of
+#translation units including the first one, all of them with functions full of if statements whose conditions mix calls to the config
+#functions with other boolean expressions. Each translation unit also has a class template with the same kind of function, instantiated
+#many times, so the time spent matching also shows whether templates are visited once or once per instantiation. It also writes
+#compile_commands.json and a terms file for the tool
+
+import argparse
+import json
+import os
+import random
+
+CONFIG_HPP = '''#include <string>
+
+bool configOption(std::string a, int b);
+bool configVariable(std::string a, int b, char cc);
+
+namespace zzz {
+bool config(std::string a, int b, int r);
+};
+'''
+
+class Generator:
+    def __init__(self, args):
+        self.args = args
+        self.random = random.Random(args.seed)
+        self.terms = ['Term%d' % i for i in xrange(args.terms)]
+
+    def configCall(self):
+        term = self.random.choice(self.terms)
+        kind = self.random.randint(0, 2)
+        if kind==0:
+            return 'configVariable("%s", 3, 4)' % term
+        elif kind==1:
+            return 'configOption("%s", 3)' % term
+        return 'zzz::config("%s", 3, 4)' % term
+
+    #boolean expression with nesting levels of logical operators, with config calls and local variables as leaves
+    def condition(self, nesting):
+        if nesting==0:
+            leaf = self.configCall() if self.random.random()<0.5 else self.random.choice(['a', 'b', '(n > 3)', '(n < 7)'])
+            return ('!' if self.random.random()<0.2 else '')+leaf
+        op = self.random.choice([' && ', ' || '])
+        return '(%s%s%s)' % (self.condition(nesting-1), op, self.condition(nesting-1))
+
+    def branch(self, indent, label):
+        return ''.join('%s    n += %d; printf("%s %d\\n");\n' % (indent, i, label, i) for i in xrange(self.args.branch_lines))
+
+    def function(self, name, signature=None):
+        lines = ['%s {\n' % (signature or 'int %s(bool a, bool b)' % name), '    int n = 0;\n']
+        for i in xrange(self.args.calls_per_function):
+            lines.append('    if (%s) {\n' % self.condition(self.args.nesting))
+            lines.append(self.branch('    ', 'then %s %d' % (name, i)))
+            lines.append('    } else {\n')
+            lines.append(self.branch('    ', 'else %s %d' % (name, i)))
+            lines.append('    }\n')
+        lines.append('    return n;\n}\n\n')
+        return ''.join(lines)
+
+    def header(self, level):
+        guard = 'BENCH_HEADER_%d_HPP' % level
+        text = ['#ifndef %s\n#define %s\n\n' % (guard, guard), '#include <stdio.h>\n']
+        if level+1<self.args.header_depth:
+            text.append('#include "header%d.hpp"\n' % (level+1))
+        else:
+            text.append('#include "config.hpp"\n')
+        text.append('\n')
+        for f in xrange(self.args.header_functions):
+            text.append('inline ' + self.function('header%d_f%d' % (level, f)))
+        text.append('#endif\n')
+        return ''.join(text)
+
+    #class template with a static function like the other ones, explicitly instantiated (so every member is) template_instantiations times
+    def template(self, tu):
+        name = 'tu%d_T' % tu
+        text = ['template <int K> struct %s {\n' % name, 'static ' + self.function(name, 'int run(bool a, bool b)'), '};\n\n']
+        text.extend('template struct %s<%d>;\n' % (name, k) for k in xrange(self.args.template_instantiations))
+        return ''.join(text)+'\n'
+
+    def source(self, tu):
+        text = ['#include "header0.hpp"\n\n' if self.args.header_depth>0 else '#include <stdio.h>\n#include "config.hpp"\n\n']
+        for f in xrange(self.args.functions):
+            text.append(self.function('tu%d_f%d' % (tu, f)))
+        if self.args.template_instantiations>0:
+            text.append(self.template(tu))
+        return ''.join(text)
+
+    def write(self, path, text):
+        with open(path, 'w') as f:
+            f.write(text)
+
+    def run(self):
+        root = os.path.abspath(self.args.outdir)
+        include = os.path.join(root, 'include')
+        if not os.path.isdir(include):
+            os.makedirs(include)
+        self.write(os.path.join(include, 'config.hpp'), CONFIG_HPP)
+        for level in xrange(self.args.header_depth):
+            self.write(os.path.join(include, 'header%d.hpp' % level), self.header(level))
+        commands = []
+        for tu in xrange(self.args.tus):
+            path = os.path.join(root, 'tu%d.cpp' % tu)
+            self.write(path, self.source(tu))
+            commands.append({'directory': root, 'command': 'clang++ -std=c++11 -Iinclude -c tu%d.cpp -o tu%d.o' % (tu, tu), 'file': path})
+        self.write(os.path.join(root, 'compile_commands.json'), json.dumps(commands, indent=2))
+        #half of the terms are refactored out
+        self.write(os.path.join(root, 'terms.txt'), ''.join('%s=%s\n' % (term, 'true' if i%2==0 else 'false') for i, term in enumerate(self.terms) if i%4<2))
+        return [command['file'] for command in commands]
+
+def addArguments(parser):
+    parser.add_argument('--tus', type=int, default=50, help='number of translation units')
+    parser.add_argument('--functions', type=int, default=20, help='functions in each translation unit')
+    parser.add_argument('--header-depth', type=int, default=8, help='length of the chain of headers included by each translation unit')
+    parser.add_argument('--header-functions', type=int, default=5, help='inline functions in each header')
+    parser.add_argument('--calls-per-function', type=int, default=4, help='if statements with config calls in each function')
+    parser.add_argument('--branch-lines', type=int, default=10, help='statements in each branch of the if statements')
+    parser.add_argument('--nesting', type=int, default=2, help='nesting of logical operators in the conditions')
+    parser.add_argument('--template-instantiations', type=int, default=100, help='instantiations of the class template in each translation unit (0: no template)')
+    parser.add_argument('--terms', type=int, default=20, help='number of different config terms')
+    parser.add_argument('--seed', type=int, default=1, help='seed for the random choices, so the trees can be reproduced')
+
+if __name__=='__main__':
+    parser = argparse.ArgumentParser(description='generate a synthetic code base to benchmark simpleRefactor')
+    parser.add_argument('outdir', help='directory for the generated tree')
+    addArguments(parser)
+    args = parser.parse_args()
+    files = Generator(args).run()
+    print "Generated %d translation units in %s" % (len(files), args.outdir)
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <string>
+
+bool configOption(std::string a, int b);
+bool configVariable(std::string a, int b, char cc);
+
+//COMMENTS ASSUME THAT CONFIG VALUE IS true, WITH --remove-dead-bools
+
+//REMOVED: static, and all its calls are replaced by true
+static bool useSpanish() { return configOption("UseSpanishLanguage", 3); }
+
+//KEPT (other translation units may call it), but its calls are replaced by true
+bool isSpanish() { return configVariable("UseSpanishLanguage", 1, 2); } //REWRITTEN TO true
+
+class Greeter {
+    //REMOVED: private, and all its values are true
+    bool spanish = configOption("UseSpanishLanguage", 3);
+    //KEPT: not all its values are constant
+    bool loud = false;
+public:
+    void setLoud(bool l) {
+        loud = l;
+        //REMOVED
+        spanish = isSpanish();
+    }
+    void greet() {
+        //REWRITTEN (then BRANCH): HOLA
+        if (spanish) printf(loud ? "HOLA!\n" : "HOLA\n"); else printf(loud ? "HELLO!\n" : "HELLO\n");
+    }
+};
+
+int main(int argc, char **argv) {
+    Greeter g;
+    //REMOVED
+    bool both = useSpanish() && isSpanish();
+    //REMOVED: its value is true once both is true
+    bool chained = both || argc > 1;
+    //KEPT: its address is taken
+    bool verbose = configOption("UseSpanishLanguage", 3); //REWRITTEN TO true
+    bool *pv = &verbose;
+    g.setLoud(argc > 2);
+    //REWRITTEN (then BRANCH): g.greet()
+    if (chained) g.greet(); else printf("BYE\n");
+    //REWRITTEN: 1
+    int n = both ? 1 : 2;
+    printf("%d %d\n", n, (int)*pv);
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef SHARED_HPP
+#define SHARED_HPP
+
+#include <stdio.h>
+#include <string>
+
+bool configOption(std::string a, int b);
+bool configVariable(std::string a, int b, char cc);
+
+//COMMENTS ASSUME THAT CONFIG VALUE IS true
+//pch1.cpp and pch2.cpp start with the same #includes, this one among them, so with --pch-cache it is in a precompiled header shared by both
+
+inline bool sharedSpanish() { return configVariable("UseSpanishLanguage",3,4); } //REWRITTEN TO true
+
+inline void sharedGreet() {
+     if ((((configVariable("UseSpanishLanguage", 1,2))))){printf("UNO_SHARED");}else{printf("ONE_SHARED");}
+}
+
+#endif
@@ -0,0 +1,13 @@
+#include <stdio.h>
+#include <string>
+#include "shared.hpp"
+
+//COMMENTS ASSUME THAT CONFIG VALUE IS true
+
+bool pch1() { return !configVariable("UseSpanishLanguage",3,4); } //REWRITTEN TO false
+
+int pch1Greet() {
+     sharedGreet();
+     if ((((configVariable("UseSpanishLanguage", 1,2))))){printf("UNO_PCH1");}else{printf("ONE_PCH1");}
+     return sharedSpanish() && pch1() ? 0 : 1;
+}
@@ -0,0 +1,13 @@
+#include <stdio.h>
+#include <string>
+#include "shared.hpp"
+
+//COMMENTS ASSUME THAT CONFIG VALUE IS true
+
+bool pch2() { return !configVariable("UseSpanishLanguage",3,4); } //REWRITTEN TO false
+
+int pch2Greet() {
+     sharedGreet();
+     if ((((configVariable("UseSpanishLanguage", 1,2))))){printf("UNO_PCH2");}else{printf("ONE_PCH2");}
+     return sharedSpanish() && pch2() ? 0 : 1;
+}
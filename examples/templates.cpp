@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include <string>
+
+bool configOption(std::string a, int b);
+bool configVariable(std::string a, int b, char cc);
+
+//COMMENTS ASSUME THAT CONFIG VALUE IS true
+//Unroll<200>::run() instantiates Unroll<N> 200 times, but each call site is written (and rewritten) just once
+
+template<int N> struct Unroll {
+    static bool check(bool q) { return ((!q)) && configVariable("UseSpanishLanguage",3,4); } //REWRITTEN TO !q
+
+    static int run() {
+        int n = Unroll<N-1>::run();
+        //REWRITTEN (then BRANCH): UNO
+        if ((((configVariable("UseSpanishLanguage", 1,2))))){printf("UNO");}else{printf("ONE");}
+        //REWRITTEN: DOS
+        if (configOption(((("UseSpanishLanguage"))), 3))     printf("DOS"); else         printf("TWO");
+        return n+N+check(n>N);
+    }
+};
+
+template<> struct Unroll<0> {
+    static int run() { return 0; }
+};
+
+//the call is resolved only when the template is instantiated
+template<typename T> bool dependentCall(const T &t) { return configOption("UseSpanishLanguage", t.size()); } //REWRITTEN TO true
+
+int main() {
+    std::string s;
+    return Unroll<200>::run() + dependentCall(s);
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <string>
+
+bool configOption(std::string a, int b);
+bool configVariable(std::string a, int b, char cc);
+
+//EACH CALL IS INDEXED WITH THE USE CASE IN ITS COMMENT
+
+static bool global = configOption("UseSpanishLanguage", 1); //vardecl
+
+struct Greeter {
+    bool spanish = configOption("UseSpanishLanguage", 2); //other (a field, not a variable)
+};
+
+int main(int n, char **argv) {
+    bool local = configVariable("UseSpanishLanguage", 3, 4); //vardecl
+    bool negated = !configOption("UseSpanishLanguage", 5) && n>1; //vardecl
+    bool first = true, second = configOption("UseSpanishLanguage", 6); //vardecl
+    bool chosen = configOption("UseSpanishLanguage", 7) ? first : second; //conditional
+    bool flag;
+    flag = configVariable("UseSpanishLanguage", 8, 9); //assignment
+    if (configOption("UseSpanishLanguage", 10)) { printf("HOLA"); } //if
+    printf("%d", configOption("UseSpanishLanguage", 11)); //other
+    while (configOption("UseSpanishLanguage", 12)) { --n; } //other
+    return global+local+negated+chosen+flag+n;
+}
@@ -1,20 +1,49 @@
 #!/usr/bin/python
 
 from lxml import etree
+from multiprocessing.pool import ThreadPool
+import hashlib
+import json
+import os
 import requests
+import requests.adapters
+import tempfile
 
 class GrokScraper:
-    __slots__ = ['url', 'domain', 'proj', 'path', 'nresults', 'errors', 'getRevisionText']
+    __slots__ = ['url', 'domain', 'proj', 'path', 'nresults', 'errors', 'getRevisionText', 'getLatestRevision', 'workers', 'cachedir', 'session']
     
     def __init__(self, **kwargs):
         #different grok versions might place the revision data in a different part of the DOM relative to the line elements, so use this as a means to customize the extraction code
-        self.getRevisionText = lambda occurrence: occurrence.getnext().iterchildren().__next__()
+        self.getRevisionText = lambda occurrence: next(occurrence.getnext().iterchildren())
+        #maximum number of concurrent requests to grok (each one with its own pooled connection)
+        self.workers = 8
+        #if given, the revisions of each annotated file are cached in this directory, and the file is only downloaded again if grok says it changed
+        self.cachedir = None
+        #the latest revision of a file, from the DOM of its history page (the first link to a revision in the table of revisions, newest first).
+        #Only used with cachedir, for the files whose annotated page comes without ETag or Last-Modified
+        self.getLatestRevision = lambda root: root.xpath(".//table[@id='revisions']//a[contains(@href, 'r=')]")[0].text
         for name, val in kwargs.iteritems():
             if name in self.__slots__:
                 setattr(self, name, val)
             else:
                 raise RuntimeError('Invalid attribute <%s> for class GrokScraper!' % str(name))
-        
+        if not hasattr(self, 'session'):
+            self.session = requests.Session()
+            adapter = requests.adapters.HTTPAdapter(pool_connections=1, pool_maxsize=self.workers)
+            self.session.mount('http://', adapter)
+            self.session.mount('https://', adapter)
+
+    #f(x) for each x in args, with at most self.workers calls at once
+    def mapConcurrently(self, f, args):
+        if len(args)<=1:
+            return map(f, args)
+        pool = ThreadPool(min(self.workers, len(args)))
+        try:
+            return pool.map(f, args)
+        finally:
+            pool.close()
+            pool.join()
+
     def getOcurrences(self, term):
         table = dict()
         if self.domain != '':
@@ -22,7 +51,7 @@ class GrokScraper:
         else:
             domain = ''
         url = "%s%s/search?q=%s&project=%s&defs=&path=%s&hist=&n=%d" % (self.url, domain, term, self.proj, self.path, self.nresults)
-        r = requests.get(url)
+        r = self.session.get(url)
         if r.ok:
             root = etree.HTML(r.text.encode('ascii', errors='replace'))
             xp = ".//tt/a/b[text()='%s']/.." % term
@@ -40,39 +69,137 @@ class GrokScraper:
             handleError(url, r, self.errors)
         return table
 
+    #the ocurrences of several terms in a single table, searching for all of them concurrently
+    def getOcurrencesForTerms(self, terms):
+        table = dict()
+        for t in self.mapConcurrently(self.getOcurrences, list(terms)):
+            for f, lines in t.iteritems():
+                table.setdefault(f, set()).update(lines)
+        return table
+
+    #{line: revision} and {revision: comment} for all the lines of an annotated file, in a single pass over the DOM
+    def parseAnnotations(self, text):
+        root = etree.HTML(text.encode('ascii', errors='replace'))
+        lines = dict()
+        comments = dict()
+        for a in root.iter('a'):
+            if a.get('class') not in ('l', 'hl') or a.get('name') is None or not a.get('name').isdigit():
+                continue
+            try:
+                occ = self.getRevisionText(a)
+            except (AttributeError, StopIteration):
+                #lines without revision data
+                continue
+            rev = occ.text
+            lines[int(a.get('name'))] = rev
+            if not rev in comments:
+                comments[rev] = occ.attrib['title']
+        return lines, comments
+
+    #cache entries are keyed by the URL of the annotated page, and also by the latest revision of the file if the page has no ETag or Last-Modified
+    def cachePath(self, url, revision):
+        key = url if revision is None else '%s\n%s' % (url, revision)
+        return os.path.join(self.cachedir, hashlib.sha1(key.encode('utf-8')).hexdigest()+'.json')
+
+    def readCache(self, url, revision=None):
+        if self.cachedir is None:
+            return None
+        try:
+            with open(self.cachePath(url, revision), 'r') as f:
+                entry = json.load(f)
+        except (IOError, ValueError):
+            return None
+        if entry.get('url')!=url or entry.get('revision')!=revision:
+            return None
+        return entry
+
+    #entries for pages with ETag or Last-Modified are keyed just by the URL, to ask for the page only if it changed. For pages without them,
+    #entries are only useful if the latest revision of the file is known: they are keyed by it, and are never revalidated
+    def writeCache(self, url, revision, r, lines, comments):
+        if self.cachedir is None:
+            return
+        if r.headers.get('ETag') is not None or r.headers.get('Last-Modified') is not None:
+            revision = None
+        elif revision is None:
+            return
+        if not os.path.isdir(self.cachedir):
+            try:
+                os.makedirs(self.cachedir)
+            except OSError:
+                #another worker just created it
+                pass
+        entry = {'url': url, 'revision': revision, 'etag': r.headers.get('ETag'), 'modified': r.headers.get('Last-Modified'), 'lines': lines, 'comments': comments}
+        fd, tmp = tempfile.mkstemp(dir=self.cachedir)
+        with os.fdopen(fd, 'w') as f:
+            json.dump(entry, f)
+        os.rename(tmp, self.cachePath(url, revision))
+
+    #the latest revision of a file according to its history page, or None if grok does not give it
+    def getHistoryRevision(self, f):
+        url = "%s%s" % (self.url, f.replace('/xref/', '/history/', 1))
+        r = self.session.get(url)
+        if not r.ok:
+            return None
+        try:
+            return self.getLatestRevision(etree.HTML(r.text.encode('ascii', errors='replace')))
+        except (AttributeError, IndexError, StopIteration):
+            return None
+
+    #({line: revision}, {revision: comment}) for a file, or None if grok does not serve its annotated source. With a cache entry for the URL
+    #(the page had an ETag or Last-Modified), the page is requested conditionally; otherwise, the latest revision of the file is looked up in
+    #its history page, and the page is not requested at all if there is an entry for it
+    def getAnnotations(self, f):
+        url = "%s%s?a=true" %(self.url, f)
+        entry = self.readCache(url)
+        revision = None
+        headers = dict()
+        if entry is not None:
+            if entry['etag'] is not None:
+                headers['If-None-Match'] = entry['etag']
+            if entry['modified'] is not None:
+                headers['If-Modified-Since'] = entry['modified']
+        elif self.cachedir is not None:
+            revision = self.getHistoryRevision(f)
+            if revision is not None:
+                cached = self.readCache(url, revision)
+                if cached is not None:
+                    return dict((int(line), rev) for line, rev in cached['lines'].iteritems()), cached['comments']
+        r = self.session.get(url, headers=headers)
+        if r.status_code==304 and entry is not None:
+            return dict((int(line), rev) for line, rev in entry['lines'].iteritems()), entry['comments']
+        if not r.ok:
+            handleError(url, r, self.errors)
+            return None
+        lines, comments = self.parseAnnotations(r.text)
+        self.writeCache(url, revision, r, lines, comments)
+        return lines, comments
 
     def getRevisions(self, table):
         revisions = dict()
-        for f, lines in table.iteritems():
-            #This assumes that grok is responsive serving annotated sources for all affected ones. Thia might not be the case for some files, and these should be filtered out here
-            url = "%s%s?a=true" %(self.url, f)
-            r = requests.get(url)
-            if r.ok:
-                root = etree.HTML(r.text.encode('ascii', errors='replace'))
-                for line in lines:
-                    xp = ".//a[@class='l' and @name='%d']" % line
-                    occs = root.xpath(xp)
-                    if (len(occs)==0):
-                        #this is cheaper than using a more complex boolean condition like ".//a[(@class='l' or @class='hl') and @name='%d']"
-                        xp = ".//a[@class='hl' and @name='%d']" % line
-                        occs = root.xpath(xp)
-                    #I wouldn't need this contraption if I could express in xpath how to locate an element relative to an adjacent one, something like ".//a[@class='l' and @name='%d']/following::span/a"
-                    occ = self.getRevisionText(occs[0])
-                    rev = occ.text
-                    comment = occ.attrib['title']
-                    if not rev in revisions:
-                        revisions[rev] = comment.encode('utf-8').replace('\x0a', ' ').replace('<br/>', '\n')
-            else:
-                handleError(url, r, self.errors)
+        files = sorted(table.keys())
+        #This assumes that grok is responsive serving annotated sources for all affected ones. Files it does not serve are left out
+        for f, annotations in zip(files, self.mapConcurrently(self.getAnnotations, files)):
+            if annotations is None:
+                continue
+            lines, comments = annotations
+            for line in table[f]:
+                rev = lines.get(line)
+                if rev is None:
+                    reportError("No revision data for line %d of <%s>" % (line, f), self.errors)
+                    continue
+                if not rev in revisions:
+                    revisions[rev] = comments[rev].encode('utf-8').replace('\x0a', ' ').replace('<br/>', '\n')
         return revisions
 
+def reportError(msg, errors):
+    if errors=='raise':
+        raise RuntimeError(msg)
+    elif errors=='print':
+        print msg
+
 def handleError(url, r, errors):
     if errors!='ignore':
-        msg = "Error retrieving grok data for <%s>: %d %s" % (url, r.status_code, r.reason)
-        if errors=='raise':
-            raise RuntimeError()
-        elif errors=='print':
-            print msg
+        reportError("Error retrieving grok data for <%s>: %d %s" % (url, r.status_code, r.reason), errors)
 
 def printOcurrences(table):
     print "NUMBER OF FILES: %d\n" % len(table)
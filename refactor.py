@@ -4,42 +4,111 @@ from lxml import etree
 import grokscrap as gs
 import os
 import subprocess as subp
+import mmap
+import struct
+import hashlib
+import json
+import threading
+import collections
+import multiprocessing
+import shutil
 import re
 
-#This class allows for (very handy) re-entrant lists of command-line calls. All you need is to call startStep() at the beginning and make sure to call endStep() at the end only if there was no problem and the list doesn't have to be replayed. And, of course, do not change the list across runs, at least in the parts already executed, or hard-to-debug problems will ensue
+#a unit of work for ExecuteContext.runJobs: a command line (or a python function, run instead of a command), identified by key (a hash of
+#everything that determines its result, see jobKey). cost is used to schedule the biggest jobs first, and files() returns the files whose contents
+#have to stay the same for the job to be considered done in a later run (typically, the files it read and the ones it wrote)
+class Job:
+    def __init__(self, key, command=None, function=None, cwd=None, cost=0, files=lambda: []):
+        self.key = key
+        self.command = command
+        self.function = function
+        self.cwd = cwd
+        self.cost = cost
+        self.files = files
+
+def hashFile(path):
+    h = hashlib.sha1()
+    with open(path, 'rb') as f:
+        for chunk in iter(lambda: f.read(1<<20), b''):
+            h.update(chunk)
+    return h.hexdigest()
+
+def jobKey(*parts):
+    return hashlib.sha1('\0'.join(parts)).hexdigest()
+
+#Jobs are dealt to one shard per worker, biggest first, so each worker starts with a balanced share. A worker takes the biggest job left in
+#its own shard, and when it runs out, steals the biggest job left in the shard with most work left
+class WorkQueue:
+    def __init__(self, jobs, numShards):
+        self.lock = threading.Lock()
+        self.shards = [collections.deque() for i in xrange(numShards)]
+        self.left = [0]*numShards
+        for i, job in enumerate(sorted(jobs, key=lambda job: -job.cost)):
+            self.shards[i%numShards].append(job)
+            self.left[i%numShards] += job.cost
+        self.stopped = False
+
+    def get(self, shard):
+        with self.lock:
+            if self.stopped:
+                return None
+            if len(self.shards[shard])==0:
+                shard = max(xrange(len(self.shards)), key=lambda s: (self.left[s], len(self.shards[s])))
+                if len(self.shards[shard])==0:
+                    return None
+            job = self.shards[shard].popleft()
+            self.left[shard] -= job.cost
+            return job
+
+    def stop(self):
+        with self.lock:
+            self.stopped = True
+
+#This class runs the command-line calls of a refactoring in parallel, and makes them re-entrant: each job is recorded as done in its own file
+#in journalDir (named after the job key), with hashes of the contents of its files. Resuming an interrupted run skips exactly the jobs that
+#were recorded as done and whose files are still the same, so the list of jobs can change across runs, and jobs can be completed in any order.
+#All you need is to call startRun() at the beginning and make sure to call endRun() at the end only if there was no problem
 class ExecuteContext:
-    def __init__(self, execute=True, verbose=False, stampName=os.path.join(os.getcwd(), 'step.txt')):
+    def __init__(self, execute=True, verbose=False, journalDir=os.path.join(os.getcwd(), 'journal'), jobs=1):
         self.execute = execute
         self.verbose = verbose
-        self.resumeFrom = None
-        self.stampName = stampName
-        self.step = 0
-
-    def writeStep(self, n):
-        self.step = n
-        with open(self.stampName, 'w') as f:
-            f.write(str(n))
-
-    def startStep(self):
-        if os.path.isfile(self.stampName):
-            with open(self.stampName, 'r') as f:
-                self.resumeFrom = int(f.read())
-        else:
-            self.resumeFrom = None
-        self.writeStep(0)
+        self.journalDir = journalDir
+        self.jobs = jobs if jobs>0 else multiprocessing.cpu_count()
+        self.printLock = threading.Lock()
 
-    def endStep(self):
-        if os.path.isfile(self.stampName):
-            os.remove(self.stampName)
+    def startRun(self):
+        if not os.path.isdir(self.journalDir):
+            os.makedirs(self.journalDir)
 
-    def checkStep(self):
-        if (self.execute):
-            if self.resumeFrom==self.step:
-                self.resumeFrom=None
-        return self.execute and self.resumeFrom is None
+    def endRun(self):
+        if os.path.isdir(self.journalDir):
+            shutil.rmtree(self.journalDir)
 
-    def updateStep(self):
-        self.writeStep(self.step+1)
+    def log(self, message):
+        if self.verbose:
+            with self.printLock:
+                print message
+
+    def journalPath(self, job):
+        return os.path.join(self.journalDir, job.key+'.json')
+
+    def isDone(self, job):
+        try:
+            with open(self.journalPath(job), 'r') as f:
+                entry = json.load(f)
+            return all(os.path.isfile(path) and hashFile(path)==h for path, h in entry['files'].iteritems())
+        except (IOError, ValueError, KeyError):
+            return False
+
+    def markDone(self, job):
+        if not os.path.isdir(self.journalDir):
+            os.makedirs(self.journalDir)
+        entry = {'files': dict((path, hashFile(path)) for path in job.files() if os.path.isfile(path))}
+        path = self.journalPath(job)
+        with open(path+'.tmp', 'w') as f:
+            json.dump(entry, f)
+        #the entry is either complete or missing
+        os.rename(path+'.tmp', path)
 
     def actualDoCommand(self, command, **kwargs):
         #this is intended to actually do subprocess call, as some esoteric special-needs tools might be so picky about how exactly they are invoked that you can't yjust assume that a straight subptocess.Popen/call will work
@@ -47,20 +116,53 @@ class ExecuteContext:
         return subp.call(command, **kwargs)
 
     def doCommand(self, command, **kwargs):
-        if self.verbose:
-            print ' '.join(command)
-        if self.checkStep():
+        self.log(' '.join(command))
+        if self.execute:
             ret = self.actualDoCommand(command, **kwargs)
             if ret!=0:
                 raise RuntimeError("Error in command <%s>" % ' '.join(command))
-        self.updateStep()
 
-    def doCd(self, dr):
-        if self.checkStep() or True: #as chdirs have critically important side-effects, they have to be replayed no matter what
-            os.chdir(dr)
-        self.updateStep()
-        if self.verbose:
-            print "cd "+dr
+    def runJob(self, job):
+        if self.isDone(job):
+            self.log('ALREADY DONE: %s' % (' '.join(job.command) if job.command is not None else job.key))
+            return
+        if job.function is not None:
+            job.function()
+        else:
+            self.doCommand(job.command, cwd=job.cwd)
+        self.markDone(job)
+
+    def worker(self, queue, shard, errors):
+        while True:
+            job = queue.get(shard)
+            if job is None:
+                return
+            try:
+                self.runJob(job)
+            except Exception as e:
+                #jobs already running are completed (and recorded) by the other workers, but no new ones are started
+                errors.append(e)
+                queue.stop()
+
+    #run the jobs with self.jobs workers, skipping the ones done in a previous run
+    def runJobs(self, jobs):
+        if not self.execute:
+            return
+        queue = WorkQueue(jobs, max(1, min(self.jobs, len(jobs))))
+        errors = []
+        threads = [threading.Thread(target=self.worker, args=(queue, shard, errors)) for shard in xrange(len(queue.shards))]
+        for thread in threads:
+            thread.daemon = True
+            thread.start()
+        for thread in threads:
+            #join with a timeout, so KeyboardInterrupt gets through
+            while thread.is_alive():
+                thread.join(1)
+        if len(errors)>0:
+            raise errors[0]
+
+#file paths in the YAML files written with --export-edits
+FILEPATH_RE = re.compile(r'^[-\s]*FilePath:\s*(.*?)\s*$')
 
 #simple but high-level driver for the refactor binary, it basically does housekeeping and high-level planning; the binary does the grunt work.
 class ExternalRefactor:
@@ -74,9 +176,12 @@ class ExternalRefactor:
                  cppextensions=('.cpp',), 
                  hppextensions=('.hpp', '.h'),
                  getCppForHpp=None,
+                 includegraph=None,
+                 compdb=None,
                  grokscraper=None,
                  isxmlfile=lambda x: x.endswith(('.xml',)), 
                  xml_xpath=None, 
+                 editsdir=os.path.join(os.getcwd(), 'edits'),
                  execute=True,
                  verbose=True):
         self.context = context
@@ -88,75 +193,157 @@ class ExternalRefactor:
         self.cppextensions = cppextensions
         self.hppextensions = hppextensions
         self.getCppForHpp = getCppForHpp
+        #a CallSiteIndex, used to choose which cpp files to refactor for the headers with occurrences
+        self.includegraph = includegraph
+        #directory with compile_commands.json: if given, the compiler arguments are taken from there instead of compiler_args_base and compiler_args
+        self.compdb = compdb
         self.grokscraper = grokscraper
         self.xml_xpath = xml_xpath
         self.isxmlfile = isxmlfile
+        self.editsdir = editsdir
         self.execute = execute
         self.verbose = verbose
-        self.template = lambda term, value, filepath: [self.command, '--term=%s' % term, '--value=%s' % value, '--overwrite=true', filepath, '--']
+        #each invocation of the binary tool exports its edits instead of overwriting the files; all of them are applied at once in applyEdits(), so headers shared by several cpp files are written just once
+        self.pendingEdits = []
+        #{translation unit: parse time}, read from includegraph when first needed
+        self.parseCosts = None
+        self.template = lambda term, value, filepath, editsfile: [self.command, '--term=%s' % term, '--value=%s' % value, '--export-edits=%s' % editsfile]+self.filespec(filepath)
+        self.template_batch = lambda termsfile, filepath, editsfile: [self.command, '--terms-file=%s' % termsfile, '--export-edits=%s' % editsfile]+self.filespec(filepath)
+        #without xml_xpath, the <value name=...> entries are removed by the xml subcommand of the binary tool, which leaves the rest of the file untouched
+        self.template_xml = lambda termspec, filepath: [self.command, 'xml', termspec, '--overwrite', filepath]
+
+    #source file and compiler arguments for the binary tool
+    def filespec(self, filepath):
+        if self.compdb is not None:
+            return ['-p', self.compdb, filepath]
+        return [filepath, '--']+self.compiler_args_base+self.compiler_args(filepath)
 
     #do not forget to call this one if you want to make sure to also refactor instances that only apper in header files!
+    #As edits are merged across cpp files, it does not matter if several cpp files including the same header are refactored.
+    #With an includegraph, all the headers are covered at once with as few (and as cheap) cpp files as possible; paths are absolute then,
+    #so translatepath has to leave them alone
     def addCppFilesForHppFiles(self, table):
-        for filename in table:
-            if filename.endswith(self.hppextensions):
-                cpp = None
-                if self.getCppForHpp is not None:
-                    cpp = self.getCppForHpp(filename) #paths returned here should be consistent with grok, rather than with the codebase
-                elif self.grokscraper is not None:
-                    cpp = self.getCppForHppWithGrok(filename, table)
-                if cpp is None:
-                    raise RuntimeError("Could not find a C++ source file including the header %s!!!!!" % filename)
-                if cpp in table:
-                    table[cpp].add(filename)
-                else:
-                    table[cpp] = set([filename])
-
-    def getCppForHppWithGrok(self, hppfile, table):
-        filename = hppfile.rsplit('/', 1)[1]
-        hpptable = self.grokscraper.getOcurrences("include "+filename)
-        #first check if the file is already in the table
-        for grokfilepath in hpptable:
-            if grokfilepath.endswith(self.cppextensions) and grokfilepath in table:
-                return grokfilepath
-        #this is a quite dumb brute-force approach, it might be far better to avoid greedy strategies and compute a minimal set of cpps for all hpps with ocurrences; however that might be inefficient for codebases with massively nested sets of header files
-        for grokfilepath in hpptable:
-            if grokfilepath.endswith(self.cppextensions):
-                return grokfilepath
-        for grokfilepath in hpptable:
-            if grokfilepath.endswith(self.hppextensions):
-                ret = self.getCppForHppWithGrok(grokfilepath)
-                if ret is not None:
-                    return ret
-        #there might be headers not included anywhere in the codebase (conceivably, they might be included by source files generated during the build process). If that's the case, here we should add some code to (a) use those generated sources (after compilation) or (b) generate some phony C++ source file that just includes the header and feed it to the binary tool 
-        return None
+        hppfiles = [filename for filename in table if filename.endswith(self.hppextensions)]
+        if self.includegraph is not None:
+            abspaths = dict((os.path.abspath(self.translatepath(filename)), filename) for filename in hppfiles)
+            cover = self.includegraph.coverHeaders(abspaths.keys())
+            covered = set()
+            for cpp, hpps in cover.iteritems():
+                table.setdefault(cpp, set()).update(abspaths[hpp] for hpp in hpps)
+                covered.update(hpps)
+            for hpp in abspaths:
+                if hpp not in covered:
+                    #there might be headers not included anywhere in the codebase (conceivably, they might be included by source files generated during the build process)
+                    raise RuntimeError("Could not find a C++ source file including the header %s!!!!!" % abspaths[hpp])
+            return
+        for filename in hppfiles:
+            cpp = None
+            if self.getCppForHpp is not None:
+                cpp = self.getCppForHpp(filename) #paths returned here should be consistent with grok, rather than with the codebase
+            if cpp is None:
+                raise RuntimeError("Could not find a C++ source file including the header %s!!!!!" % filename)
+            if cpp in table:
+                table[cpp].add(filename)
+            else:
+                table[cpp] = set([filename])
 
-    def doCPPFile(self, term, value, filepath):
-        commandline = self.template(term, value, filepath)+self.compiler_args_base+self.compiler_args(filepath)
+    #edits files are named after the job key, so a resumed run finds the edits of the jobs it skips
+    def newEditsFile(self, key):
+        if not os.path.isdir(self.editsdir):
+            os.makedirs(self.editsdir)
+        editsfile = os.path.join(self.editsdir, '%s.yaml' % key)
+        self.pendingEdits.append(editsfile)
+        return editsfile
+
+    #translation units are scheduled by their parse time if the includegraph knows it, by their size otherwise
+    def getCost(self, filepath):
+        if self.includegraph is not None:
+            if self.parseCosts is None:
+                self.parseCosts = self.includegraph.getParseCosts()
+            cost = self.parseCosts.get(os.path.abspath(os.path.join(self.exedir, filepath)))
+            if cost is not None:
+                return cost
+        path = os.path.join(self.exedir, filepath)
+        return os.path.getsize(path) if os.path.isfile(path) else 0
+
+    #a job exporting the edits of a translation unit is done while the translation unit, its edits file and the files the edits apply to
+    #are left as they were (so it is run again if the edits were applied to any of them)
+    def getCPPJobFiles(self, filepath, editsfile):
+        files = [os.path.join(self.exedir, filepath), editsfile]
+        if os.path.isfile(editsfile):
+            with open(editsfile, 'r') as f:
+                for line in f:
+                    match = FILEPATH_RE.match(line)
+                    if match is not None:
+                        path = match.group(1)
+                        if path.startswith("'") and path.endswith("'"):
+                            path = path[1:-1].replace("''", "'")
+                        files.append(os.path.join(self.exedir, path))
+        return files
+
+    def cppJob(self, keyparts, template, filepath):
+        key = jobKey(*(['cpp', self.command]+keyparts+self.filespec(filepath)))
+        editsfile = self.newEditsFile(key)
+        commandline = template(editsfile)
+        if self.verbose:
+            print 'ON %s EXECUTE %s' % (self.exedir, ' '.join(commandline))
+        return Job(key, command=commandline, cwd=self.exedir, cost=self.getCost(filepath), files=lambda: self.getCPPJobFiles(filepath, editsfile))
+
+    #merge the edits exported by all the previous jobs from doCPPFile/doCPPFileBatch, and overwrite the affected files
+    def applyEdits(self):
+        if len(self.pendingEdits)==0:
+            return
+        commandline = [self.command]+['--apply-edits=%s' % editsfile for editsfile in self.pendingEdits]
         if self.verbose:
             print 'ON %s EXECUTE %s' % (self.exedir, ' '.join(commandline))
         if self.execute:
             self.context.doCommand(commandline, cwd=self.exedir)
+        self.pendingEdits = []
+
+    #the job for a cpp file, to be run with context.runJobs
+    def doCPPFile(self, term, value, filepath):
+        return self.cppJob(['term', term, str(value)], lambda editsfile: self.template(term, value, filepath, editsfile), filepath)
 
-    def doXMLFile(self, term, filepath):
+    #same as doCPPFile, but for many terms at once (see writeTermsFile), so the file is parsed just once
+    def doCPPFileBatch(self, termsfile, filepath):
+        with open(termsfile, 'r') as f:
+            terms = f.read()
+        return self.cppJob(['terms', terms], lambda editsfile: self.template_batch(termsfile, filepath, editsfile), filepath)
+
+    #the job removing the terms from an XML file: all of them at once with the xml subcommand of the binary tool, or one by one with xml_xpath
+    def doXMLFile(self, terms, filepath, termsfile=None):
+        path = os.path.join(self.exedir, filepath)
+        if self.xml_xpath is None:
+            if termsfile is not None:
+                with open(termsfile, 'r') as f:
+                    key = jobKey('xml', self.command, f.read(), path)
+                commandline = self.template_xml('--terms-file=%s' % termsfile, filepath)
+            else:
+                key = jobKey('xml', self.command, terms[0], path)
+                commandline = self.template_xml('--term=%s' % terms[0], filepath)
+            if self.verbose:
+                print 'ON %s EXECUTE %s' % (self.exedir, ' '.join(commandline))
+            return Job(key, command=commandline, cwd=self.exedir, files=lambda: [path])
         if self.verbose:
-            print 'ON %s REMOVE REFERNCES TO %s' % (filepath, term)
-        if self.execute:
-            if self.context.checkStep():
-                root = etree.parse(filepath)
+            print 'ON %s REMOVE REFERNCES TO %s' % (filepath, ', '.join(terms))
+        def remove():
+            root = etree.parse(path)
+            for term in terms:
                 res = root.xpath(self.xml_xpath % term)
                 if len(res)!=1:
-                    print "Error locating config value <%s> in XML file <%s>!!!!!" % (term, filepath)
+                    self.context.log("Error locating config value <%s> in XML file <%s>!!!!!" % (term, filepath))
                 else:
                     toremove = res[0]
                     toremove.getparent().remove(toremove)
-                    with open(filepath, 'w') as svp:
-                        svp.write(etree.tostring(root))
-            self.context.updateStep()
+            with open(path, 'w') as svp:
+                svp.write(etree.tostring(root))
+        return Job(jobKey(*(['xpath', self.xml_xpath, path]+terms)), function=remove, files=lambda: [path])
 
     #main function, does the refactoring
     def doFilesFromTable(self, table, term, value):
         if self.verbose:
             print "PROCESSING FILES FROM TERMS FOUND WITH OPENGROK\n"
+        jobs = []
         for grokfilepath in sorted(table.keys()):
             lines = list(table[grokfilepath])
             lines.sort()
@@ -164,57 +351,182 @@ class ExternalRefactor:
             if grokfilepath.endswith(self.cppextensions):
                 if self.verbose:
                     print "  TERM <%s> TO BE REFACTORED IN CPP FILE <%s> in line(s) %s" % (term, filepath, lines)
-                self.doCPPFile(term, value, filepath)
+                jobs.append(self.doCPPFile(term, value, filepath))
             if grokfilepath.endswith(self.hppextensions):
                 if self.verbose:
                     print "  TERM <%s> FOUND IN HEADER FILE <%s> in line(s) %s (refactored as part of a cpp file)" % (term, filepath, lines)
             elif self.isxmlfile(filepath):
                 if self.verbose:
                     print "  TERM <%s> TO BE REFACTORED IN XML FILE <%s> in line(s) %s" % (term, filepath, lines)
-                self.doXMLFile(term, filepath)
+                jobs.append(self.doXMLFile([term], filepath))
+        self.context.runJobs(jobs)
+        self.applyEdits()
+
+    #same as doFilesFromTable, but for many terms at once. table should have the ocurrences of all the terms, and terms is a dictionary {term: value}
+    def doFilesFromTableBatch(self, table, terms, termsfile=os.path.join(os.getcwd(), 'terms.txt')):
+        if self.verbose:
+            print "PROCESSING FILES FROM TERMS FOUND WITH OPENGROK (%d TERMS AT ONCE)\n" % len(terms)
+        writeTermsFile(terms, termsfile)
+        jobs = []
+        for grokfilepath in sorted(table.keys()):
+            lines = list(table[grokfilepath])
+            lines.sort()
+            filepath = self.translatepath(grokfilepath)
+            if grokfilepath.endswith(self.cppextensions):
+                if self.verbose:
+                    print "  TERMS TO BE REFACTORED IN CPP FILE <%s> in line(s) %s" % (filepath, lines)
+                jobs.append(self.doCPPFileBatch(termsfile, filepath))
+            if grokfilepath.endswith(self.hppextensions):
+                if self.verbose:
+                    print "  TERMS FOUND IN HEADER FILE <%s> in line(s) %s (refactored as part of a cpp file)" % (filepath, lines)
+            elif self.isxmlfile(filepath):
+                if self.verbose:
+                    print "  TERMS TO BE REFACTORED IN XML FILE <%s>" % filepath
+                jobs.append(self.doXMLFile(sorted(terms.keys()), filepath, termsfile))
+        self.context.runJobs(jobs)
+        self.applyEdits()
 
     #an example of how a high-level funtion to use GrokScraper and ExternalRefactor might look like
     def doFilesFromGrok(self, term, value, printRevs=True):
-        table = grokscraper.getOcurrences(term)
+        table = self.grokscraper.getOcurrences(term)
         self.addCppFilesForHppFiles(table)
-        self.context.startStep()
+        self.context.startRun()
         self.doFilesFromTable(table, term, value)
-        self.context.endStep()
+        self.context.endRun()
+        if printRevs:
+            print ""
+            revisions = self.grokscraper.getRevisions(table)
+            self.grokscraper.printRevisions(revisions)
+
+    #same as doFilesFromGrok, but for many terms at once ({term: value}): each C++ file is parsed and written just once
+    def doFilesFromGrokBatch(self, terms, printRevs=True):
+        table = self.grokscraper.getOcurrencesForTerms(terms)
+        self.addCppFilesForHppFiles(table)
+        self.context.startRun()
+        self.doFilesFromTableBatch(table, terms)
+        self.context.endRun()
         if printRevs:
             print ""
             revisions = self.grokscraper.getRevisions(table)
             self.grokscraper.printRevisions(revisions)
 
+#write a file with lines term=value, to be used with the --terms-file option of the binary tool
+def writeTermsFile(terms, filepath):
+    with open(filepath, 'w') as f:
+        for term in sorted(terms.keys()):
+            f.write('%s=%s\n' % (term, str(terms[term]).lower()))
+
+
+#reader for the call-site index written by "simpleRefactor index --index-file=..." (see class CallSiteIndex in simpleRefactor.cpp for the format).
+#It can be used instead of a GrokScraper (getOcurrences returns the same kind of table), and its method getCppForHpp can be passed to ExternalRefactor.
+#Paths in the index are absolute, so translatepath should be left as the identity
+class CallSiteIndex:
+    usecases = ['unknown', 'if', 'conditional', 'assignment', 'vardecl', 'other']
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        header = struct.unpack_from('<4s9I', self.data, 0)
+        if header[0]!='SRIX' or header[1]!=2:
+            raise RuntimeError("%s is not a call-site index (or it was written by another version)" % path)
+        self.numTerms, self.numFiles, self.numRecords, self.numTUs, self.numDeps, self.numRefs, self.stringBytes = header[2:9]
+        self.termsOffset   = 40
+        self.filesOffset   = self.termsOffset   + 16*self.numTerms
+        self.recordsOffset = self.filesOffset   + 16*self.numFiles
+        self.tusOffset     = self.recordsOffset + 12*self.numRecords
+        self.depsOffset    = self.tusOffset     + 24*self.numTUs
+        self.refsOffset    = self.depsOffset    + 4*self.numDeps
+        self.stringsOffset = self.refsOffset    + 4*self.numRefs
+
+    def _string(self, offset, length):
+        start = self.stringsOffset+offset
+        return self.data[start:start+length]
+
+    def _term(self, i):
+        offset, length, first, n = struct.unpack_from('<4I', self.data, self.termsOffset+16*i)
+        return self._string(offset, length), first, n
+
+    def _file(self, i):
+        offset, length = struct.unpack_from('<2I', self.data, self.filesOffset+16*i)
+        return self._string(offset, length)
+
+    #list of (path, line, use case) for all the calls with this term
+    def getCalls(self, term):
+        lo, hi = 0, self.numTerms
+        while lo<hi:
+            mid = (lo+hi)//2
+            if self._term(mid)[0]<term:
+                lo = mid+1
+            else:
+                hi = mid
+        if lo==self.numTerms:
+            return []
+        name, first, n = self._term(lo)
+        if name!=term:
+            return []
+        calls = []
+        for r in xrange(first, first+n):
+            f, line, usecase = struct.unpack_from('<3I', self.data, self.recordsOffset+12*r)
+            calls.append((self._file(f), line, self.usecases[usecase] if usecase<len(self.usecases) else 'unknown'))
+        return calls
+
+    def getOcurrences(self, term):
+        table = dict()
+        for path, line, usecase in self.getCalls(term):
+            table.setdefault(path, set()).add(line)
+        return table
+
+    def getOcurrencesForTerms(self, terms):
+        table = dict()
+        for term in terms:
+            for path, line, usecase in self.getCalls(term):
+                table.setdefault(path, set()).add(line)
+        return table
+
+    #for each translation unit, its parse cost (in ms, at least 1) and the files in wanted it includes (directly or not)
+    def _reaching(self, wanted):
+        reaching = dict()
+        for u in xrange(self.numTUs):
+            tufile, firstDep, numDeps, firstRef, numRefs, cost = struct.unpack_from('<6I', self.data, self.tusOffset+24*u)
+            reached = set()
+            for d in xrange(firstDep, firstDep+numDeps):
+                path = self._file(struct.unpack_from('<I', self.data, self.depsOffset+4*d)[0])
+                if path in wanted:
+                    reached.add(path)
+            if len(reached)>0:
+                reaching[self._file(tufile)] = (max(cost, 1), reached)
+        return reaching
+
+    #a small set of translation units that, together, include all the headers, preferring the ones that are cheap to parse (greedy weighted set
+    #cover: the translation unit reaching most headers not reached yet per millisecond of parsing is taken first). Returns {translation unit: headers}.
+    #Headers not included by any indexed translation unit are left out
+    def coverHeaders(self, headers):
+        reaching = self._reaching(set(headers))
+        candidates = sorted(reaching.keys())
+        uncovered = set()
+        for cost, reached in reaching.itervalues():
+            uncovered.update(reached)
+        cover = dict()
+        while len(uncovered)>0:
+            best = max(candidates, key=lambda tu: float(len(reaching[tu][1] & uncovered))/reaching[tu][0])
+            cover[best] = reaching[best][1] & uncovered
+            uncovered -= cover[best]
+        return cover
+
+    #{translation unit: parse cost in ms (at least 1)}
+    def getParseCosts(self):
+        costs = dict()
+        for u in xrange(self.numTUs):
+            tufile, firstDep, numDeps, firstRef, numRefs, cost = struct.unpack_from('<6I', self.data, self.tusOffset+24*u)
+            costs[self._file(tufile)] = max(cost, 1)
+        return costs
 
-#helper funtion to be used as part of function compiler_args (one of the members of ExternalRefactor): for a .d file (the one generated by the compiler detailing ALL files #included into the compilation unit), heuristically generate a list of directives to include the relevant directories
-def heuristicIncludeDirListFromDFile(dfilepath, rootDirKeyword=['include/'], hppextensions=(('.hpp', '.h')), toExclude=[], prefix=lambda x: ''):
-    with open(dfilepath, 'r') as fd:
-        text = fd.read()
-    dirs_unfiltered = set()
-    dirs_filtered = set()
-    for m in re.finditer('[_\./a-zA-Z0-9-]+', text):
-        path = m.group(0)
-        if path.endswith(hppextensions):
-            dr = path.rsplit('/', 1)[0]
-            if not dr.endswith(hppextensions) and not dr in dirs_unfiltered:
-                dirs_unfiltered.add(dr)
-                toAdd = True
-                for excl in toExclude:
-                    if dr.startswith(excl):
-                        toAdd = False
-                        break
-                if toAdd:
-                    processed = False
-                    for key in rootDirKeyword:
-                        pos = dr.find(key)
-                        if pos!=-1:
-                            processed = True
-                            dr = dr[:pos+len(key)]
-                            break
-                    if dr[-1]=='/':
-                        dr = dr[:-1]
-                    dirs_filtered.add(dr)
-    return ['-I'+prefix(dr)+dr for dr in dirs_filtered]
+    #the cheapest translation unit that includes the header (directly or not), or None
+    def getCppForHpp(self, hppfile):
+        cover = self.coverHeaders([hppfile])
+        if len(cover)==0:
+            return None
+        return cover.keys()[0]
 
 
 #########################################################
@@ -226,8 +538,9 @@ if __name__=='__main__':
     external = ExternalRefactor(context,
                                 translatepath=translatepath,
                                 compiler_args=lambda x: ["-I./examples/include"], #if we used a non-installed binary release of clang (i.e. a clang release we just unzipped somewhere where we happen to have write permissions) to compile the binary tool, we should put in this list an additionsl include pointing to the location where clang's stddef.h lives inside the clang directory tree
-                                xml_xpath="/config/value[@name='%s']",
                                 execute=True,
                                 verbose=True)
     table = {'test.cpp':[], 'config.xml':[]}
-    external.doFilesFromTable(table, "UseSpanishLanguage", "true") 
+    context.startRun()
+    external.doFilesFromTable(table, "UseSpanishLanguage", "true")
+    context.endRun() 
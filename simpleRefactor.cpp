@@ -2,32 +2,215 @@
 // Adapted from Eli Bendersky's sample code
 //------------------------------------------------------------------------------
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <memory>
+#include <chrono>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <map>
+#include <list>
+#include <queue>
+#include <tuple>
+#include <iterator>
+#include <limits>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
-#include "clang/ASTMatchers/ASTMatchFinder.h"
-#include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Frontend/ASTUnit.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendActions.h"
-#include "clang/Rewrite/Core/Rewriter.h"
+#include "clang/Lex/HeaderSearch.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/Preprocessor.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/YAMLTraits.h"
 
 using namespace clang;
-using namespace clang::ast_matchers;
 using namespace clang::driver;
 using namespace clang::tooling;
 
+enum OutputMode {OutputFile, OutputYAML, OutputDiff};
+
 static llvm::cl::OptionCategory CustomOptions("Custom options"); 
+//xml subcommand: its positional arguments are XML files, not translation units, so it has its own command line. The options it shares with
+//the refactoring mode are in both
+static llvm::cl::SubCommand XMLCommand("xml", "remove the <value name=\"term\"> entries of the terms (given with --term or --terms-file) from XML config files"); 
+static llvm::cl::list<std::string> XMLFiles(llvm::cl::Positional, llvm::cl::sub(XMLCommand), llvm::cl::desc("<XML config files>"), llvm::cl::OneOrMore); 
 static llvm::cl::extrahelp CommonHelp(CommonOptionsParser::HelpMessage); 
-static llvm::cl::opt<std::string> TermName("term", llvm::cl::cat(CustomOptions), llvm::cl::desc("config option name"), llvm::cl::value_desc("string literal (no spaces)")); 
-static llvm::cl::opt<bool> TermValue("value", llvm::cl::cat(CustomOptions), llvm::cl::desc("config option value"), llvm::cl::value_desc("true/false")); 
-static llvm::cl::opt<bool> Overwrite("overwrite", llvm::cl::cat(CustomOptions), llvm::cl::desc("overwrite source files"), llvm::cl::value_desc("true/false")); 
+static llvm::cl::opt<std::string> TermName("term", llvm::cl::cat(CustomOptions), llvm::cl::sub(*llvm::cl::TopLevelSubCommand), llvm::cl::sub(XMLCommand), llvm::cl::desc("config option name"), llvm::cl::value_desc("string literal (no spaces)")); 
+static llvm::cl::opt<bool> TermValue("value", llvm::cl::cat(CustomOptions), llvm::cl::sub(*llvm::cl::TopLevelSubCommand), llvm::cl::sub(XMLCommand), llvm::cl::desc("config option value"), llvm::cl::value_desc("true/false")); 
+static llvm::cl::opt<std::string> TermsFile("terms-file", llvm::cl::cat(CustomOptions), llvm::cl::sub(*llvm::cl::TopLevelSubCommand), llvm::cl::sub(XMLCommand), llvm::cl::desc("file with many config options to refactor in one pass: either lines with term=value, or an XML config file with <value name=\"term\" value=\"Y/N\"> entries"), llvm::cl::value_desc("filename")); 
+static llvm::cl::opt<unsigned> Jobs("j", llvm::cl::cat(CustomOptions), llvm::cl::desc("number of translation units to parse and refactor in parallel (0: one per hardware thread)"), llvm::cl::value_desc("N"), llvm::cl::init(1)); 
+static llvm::cl::opt<std::string> ExportEdits("export-edits", llvm::cl::cat(CustomOptions), llvm::cl::desc("instead of overwriting the files, write the merged edits of all translation units to this YAML file"), llvm::cl::value_desc("filename")); 
+static llvm::cl::list<std::string> ApplyEdits("apply-edits", llvm::cl::cat(CustomOptions), llvm::cl::desc("merge the edits in these YAML files (written with --export-edits) and overwrite the affected files, each one just once"), llvm::cl::value_desc("filename"), llvm::cl::ZeroOrMore); 
+static llvm::cl::opt<bool> Prefilter("prefilter", llvm::cl::cat(CustomOptions), llvm::cl::desc("skip translation units whose main file and #included files do not contain any of the terms as a string literal (default: true)"), llvm::cl::init(true)); 
+static llvm::cl::opt<bool> SkipBodies("skip-function-bodies", llvm::cl::cat(CustomOptions), llvm::cl::desc("do not parse the bodies of functions in system headers, nor those without any of the terms as a string literal between the end of the declarator and the closing brace (default: true)"), llvm::cl::init(true)); 
+static llvm::cl::opt<bool> TimeMatching("time-matching", llvm::cl::cat(CustomOptions), llvm::cl::desc("print the time spent finding and classifying the call sites in each translation unit")); 
+static llvm::cl::opt<std::string> Stats("stats", llvm::cl::cat(CustomOptions), llvm::cl::desc("write to this JSON file the time spent in each phase (parsing, matching, use case classification, rewriting, writing) and the counts of matches, edits by kind, bail-outs by reason and declarations removed by --remove-dead-bools, for each translation unit and for the whole run"), llvm::cl::value_desc("filename")); 
+static llvm::cl::opt<bool> FixedPoint("fixed-point", llvm::cl::cat(CustomOptions), llvm::cl::desc("refactor again the translation units with edits, with the rewritten files kept in memory, until no more edits come out (the boolean literals written by each iteration are simplified in the next one)")); 
+static llvm::cl::opt<unsigned> MaxIterations("max-iterations", llvm::cl::cat(CustomOptions), llvm::cl::desc("maximum number of iterations for --fixed-point (default: 10)"), llvm::cl::value_desc("N"), llvm::cl::init(10)); 
+static llvm::cl::opt<bool> RemoveDeadBools("remove-dead-bools", llvm::cl::cat(CustomOptions), llvm::cl::desc("also refactor out the local boolean variables, private boolean fields and boolean functions with a single return statement whose values fold to the same constant: their uses are replaced by it, and the declarations are removed (functions, only if they are static in the main file). All the function bodies are parsed")); 
+static llvm::cl::opt<bool> Daemon("daemon", llvm::cl::cat(CustomOptions), llvm::cl::desc("keep the translation units parsed in memory and answer refactoring requests (one per line: refactor term=value [term=value ...], stats, quit) with their edits, in the --export-edits format")); 
+static llvm::cl::opt<std::string> SocketPath("socket", llvm::cl::cat(CustomOptions), llvm::cl::desc("with --daemon, read the requests from connections to this Unix socket instead of the standard input"), llvm::cl::value_desc("path")); 
+static llvm::cl::opt<unsigned> CacheMB("cache-mb", llvm::cl::cat(CustomOptions), llvm::cl::desc("with --daemon, approximate memory limit for the parsed translation units; the least recently used ones are evicted (default: 2048)"), llvm::cl::value_desc("megabytes"), llvm::cl::init(2048)); 
+static llvm::cl::opt<std::string> PCHCache("pch-cache", llvm::cl::cat(CustomOptions), llvm::cl::desc("precompile just once the #includes that translation units with the same compiler arguments start with, and keep the precompiled headers in this directory to reuse them in later runs, while none of the files they read changes"), llvm::cl::value_desc("directory")); 
+static llvm::cl::opt<unsigned> PCHIncludes("pch-includes", llvm::cl::cat(CustomOptions), llvm::cl::desc("with --pch-cache, maximum number of leading #includes of a translation unit to precompile (default: 64)"), llvm::cl::value_desc("N"), llvm::cl::init(64)); 
+static llvm::cl::opt<std::string> IndexFile("index-file", llvm::cl::cat(CustomOptions), llvm::cl::desc("call-site index: written (or updated) by the index subcommand; when refactoring without source files, the translation units with calls for the terms are taken from it"), llvm::cl::value_desc("filename")); 
+static llvm::cl::opt<std::string> Query("query", llvm::cl::cat(CustomOptions), llvm::cl::desc("with the index subcommand, print the calls for this term found in --index-file instead of indexing"), llvm::cl::value_desc("term")); 
+static llvm::cl::opt<OutputMode> Output("output", llvm::cl::cat(CustomOptions), llvm::cl::desc("what is printed when the files are neither overwritten nor exported:"), llvm::cl::values(
+    clEnumValN(OutputFile, "file", "the main file of each translation unit, with its edits applied (default)"), 
+    clEnumValN(OutputYAML, "yaml", "the edits of each translation unit (including #included files) as soon as it is done, one YAML document in the --export-edits format for each one"), 
+    clEnumValN(OutputDiff, "diff", "the edits of each translation unit (including #included files) as soon as it is done, as a unified diff")), llvm::cl::init(OutputFile)); 
+static llvm::cl::opt<bool> Overwrite("overwrite", llvm::cl::cat(CustomOptions), llvm::cl::sub(*llvm::cl::TopLevelSubCommand), llvm::cl::sub(XMLCommand), llvm::cl::desc("overwrite source files"), llvm::cl::value_desc("true/false")); 
 
 #define FUNCTION_NAMES "configOption", "configVariable", "config"
 
+static bool parseBoolValue(StringRef text, bool &value) {
+    text = text.trim();
+    if (text.equals_lower("true") || text.equals_lower("y") || text.equals_lower("yes") || text=="1") {
+        value = true;
+    } else if (text.equals_lower("false") || text.equals_lower("n") || text.equals_lower("no") || text=="0") {
+        value = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+//very crude attribute extraction for the config XML files, good enough for the flat <value name="..." value="..."> tags they use
+static bool getXMLAttribute(StringRef tag, StringRef attr, StringRef &value) {
+    size_t pos = 0;
+    while ((pos = tag.find(attr, pos)) != StringRef::npos) {
+        size_t p = pos + attr.size();
+        bool isAttr = pos>0 && isspace((unsigned char)tag[pos-1]);
+        pos = p;
+        if (!isAttr) continue;
+        while (p<tag.size() && isspace((unsigned char)tag[p])) ++p;
+        if (p>=tag.size() || tag[p]!='=') continue;
+        ++p;
+        while (p<tag.size() && isspace((unsigned char)tag[p])) ++p;
+        if (p>=tag.size() || (tag[p]!='"' && tag[p]!='\'')) continue;
+        size_t end = tag.find(tag[p], p+1);
+        if (end==StringRef::npos) return false;
+        value = tag.slice(p+1, end);
+        return true;
+    }
+    return false;
+}
+
+//hashed lookup table with all the config terms to refactor out in this run, and the values they are to be replaced with
+class TermTable {
+    llvm::StringMap<bool> values;
+    size_t minLen, maxLen;
+
+    bool loadTermValueLines(StringRef text, std::string &error) {
+        llvm::SmallVector<StringRef, 64> lines;
+        text.split(lines, '\n', -1, false);
+        for (StringRef line : lines) {
+            line = line.trim();
+            if (line.empty() || line[0]=='#') continue;
+            std::pair<StringRef, StringRef> tv = line.split('=');
+            bool value;
+            if (tv.first.trim().empty() || !parseBoolValue(tv.second, value)) {
+                error = "invalid line <" + line.str() + ">, expected term=value";
+                return false;
+            }
+            add(tv.first.trim(), value);
+        }
+        return true;
+    }
+
+    bool loadXMLConfig(StringRef text, std::string &error) {
+        size_t pos = 0;
+        while ((pos = text.find("<value", pos)) != StringRef::npos) {
+            size_t end = text.find('>', pos);
+            if (end==StringRef::npos) break;
+            StringRef tag = text.slice(pos, end);
+            pos = end;
+            if (tag.size()>6 && !isspace((unsigned char)tag[6])) continue;
+            StringRef name, val;
+            bool value;
+            if (!getXMLAttribute(tag, "name", name) || !getXMLAttribute(tag, "value", val) || !parseBoolValue(val, value)) {
+                error = "cannot understand XML tag <" + tag.str() + ">";
+                return false;
+            }
+            add(name, value);
+        }
+        return true;
+    }
+
+public:
+    TermTable() : minLen(0), maxLen(0) {}
+
+    void add(StringRef term, bool value) {
+        values[term] = value;
+        minLen = values.size()==1 ? term.size() : std::min(minLen, term.size());
+        maxLen = std::max(maxLen, term.size());
+    }
+
+    bool contains(StringRef term) const { return values.count(term)>0; }
+
+    //lengths of the shortest and longest terms, for quick rejection of candidates
+    size_t minLength() const { return minLen; }
+    size_t maxLength() const { return maxLen; }
+
+    bool lookup(StringRef term, bool &value) const {
+        auto it = values.find(term);
+        if (it==values.end()) return false;
+        value = it->second;
+        return true;
+    }
+
+    size_t size() const { return values.size(); }
+
+    //sorted, so they are always reported in the same order
+    std::vector<std::string> getTerms() const {
+        std::vector<std::string> terms;
+        for (auto &entry : values) terms.push_back(entry.getKey());
+        std::sort(terms.begin(), terms.end());
+        return terms;
+    }
+
+    bool loadFromFile(StringRef path, std::string &error) {
+        auto buffer = llvm::MemoryBuffer::getFile(path);
+        if (!buffer) {
+            error = "cannot read file " + path.str() + ": " + buffer.getError().message();
+            return false;
+        }
+        StringRef text = (*buffer)->getBuffer();
+        if (text.ltrim().startswith("<")) {
+            return loadXMLConfig(text, error);
+        }
+        return loadTermValueLines(text, error);
+    }
+};
+
 //this function was lifted wholesale from clang
 static inline bool isWhitespaceExceptNL(unsigned char c) {
     switch (c) {
@@ -45,38 +228,550 @@ public:
     IndentRange(unsigned a, unsigned b) : start(a), size(b) {} 
 };
 
+//an edit in the original contents of a file: replace the text in [offset, offset+length) with text
+struct SourceEdit {
+    unsigned offset, length;
+    std::string text;
+    SourceEdit() : offset(0), length(0) {}
+    SourceEdit(unsigned o, unsigned l, StringRef t) : offset(o), length(l), text(t) {}
+    unsigned end() const { return offset+length; }
+    bool contains(const SourceEdit &e) const { return offset<=e.offset && e.end()<=end(); }
+    bool operator==(const SourceEdit &e) const { return offset==e.offset && length==e.length && text==e.text; }
+};
+
+//all the edits for a file produced by a translation unit, keyed by the file path and a hash of the contents they apply to.
+//This is the unit that is serialized (--export-edits) and merged across translation units (EditMerger)
+struct FileEdits {
+    std::string path;
+    uint64_t hash;
+    //sorted by offset, non-overlapping
+    std::vector<SourceEdit> edits;
+    FileEdits() : hash(0) {}
+};
+
+static uint64_t hashContents(StringRef contents) { return llvm::xxHash64(contents); }
+
+//absolute path without . and .. components, so files can be identified across translation units (and working directories)
+static std::string getCanonicalPath(StringRef name) {
+    SmallString<256> path(getAbsolutePath(name));
+    llvm::sys::path::remove_dots(path, true);
+    return path.str();
+}
+
+//apply sorted, non-overlapping edits to the contents of a file
+static std::string applyEdits(StringRef contents, const std::vector<SourceEdit> &edits) {
+    std::string result;
+    result.reserve(contents.size());
+    unsigned pos = 0;
+    for (const SourceEdit &e : edits) {
+        result.append(contents.data()+pos, e.offset-pos);
+        result += e.text;
+        pos = e.end();
+    }
+    result.append(contents.data()+pos, contents.size()-pos);
+    return result;
+}
+
+//the lines of text, each one with its line terminator (the last one may have none)
+static void splitLines(StringRef text, std::vector<StringRef> &lines) {
+    while (!text.empty()) {
+        size_t eol = text.find('\n');
+        size_t len = eol==StringRef::npos ? text.size() : eol+1;
+        lines.push_back(text.substr(0, len));
+        text = text.substr(len);
+    }
+}
+
+static void writeDiffLine(raw_ostream &out, char prefix, StringRef line) {
+    out << prefix << line;
+    if (!line.endswith("\n")) {
+        out << "\n\\ No newline at end of file\n";
+    }
+}
+
+//hunks (with 3 lines of context) of applying the edits to contents, which are the lines of a file from firstLine on. They are either all of
+//its lines from there, or end at least 3 lines after the edits. delta is the difference in line numbers between the new and the old file
+//before contents, and is updated with the hunks
+static void writeHunks(raw_ostream &out, StringRef contents, const std::vector<SourceEdit> &edits, unsigned firstLine, int &delta) {
+    const unsigned context = 3;
+    std::vector<StringRef> lines;
+    splitLines(contents, lines);
+    unsigned numLines = lines.size();
+    //starts[numLines] is the end of the contents
+    std::vector<unsigned> starts(1, 0);
+    for (StringRef line : lines) {
+        starts.push_back(starts.back()+line.size());
+    }
+    auto lineOf = [&](unsigned offset) -> unsigned {
+        unsigned line = std::upper_bound(starts.begin(), starts.end(), offset)-starts.begin()-1;
+        //appending to a last line without line terminator changes that line
+        return line==numLines && numLines>0 && !lines.back().endswith("\n") ? numLines-1 : line;
+    };
+    auto lineAfter = [&](const SourceEdit &e) -> unsigned {
+        return e.length>0 ? lineOf(e.end()-1)+1 : std::min(lineOf(e.offset)+1, numLines);
+    };
+    //runs of changed lines [first, last), with their new text
+    struct Change {
+        unsigned first, last;
+        std::string text;
+    };
+    std::vector<Change> changes;
+    for (size_t i = 0; i < edits.size();) {
+        Change c;
+        c.first = lineOf(edits[i].offset);
+        c.last = lineAfter(edits[i]);
+        size_t j = i+1;
+        while (true) {
+            for (; j < edits.size() && lineOf(edits[j].offset)<c.last; ++j) {
+                c.last = std::max(c.last, lineAfter(edits[j]));
+            }
+            std::vector<SourceEdit> inner;
+            for (size_t k = i; k < j; ++k) {
+                inner.push_back(SourceEdit(edits[k].offset-starts[c.first], edits[k].length, edits[k].text));
+            }
+            c.text = applyEdits(contents.substr(starts[c.first], starts[c.last]-starts[c.first]), inner);
+            //if the line terminator of the last line was removed, the next line is part of the change
+            if (!c.text.empty() && c.text.back()!='\n' && c.last<numLines) {
+                ++c.last;
+                continue;
+            }
+            break;
+        }
+        changes.push_back(std::move(c));
+        i = j;
+    }
+    for (size_t i = 0; i < changes.size();) {
+        size_t j = i+1;
+        for (; j < changes.size() && changes[j].first-changes[j-1].last<=2*context; ++j) {}
+        unsigned begin = changes[i].first>context ? changes[i].first-context : 0;
+        unsigned end = std::min(changes[j-1].last+context, numLines);
+        std::vector<std::vector<StringRef>> newLines(j-i);
+        unsigned oldCount = end-begin, newCount = oldCount;
+        for (size_t k = i; k < j; ++k) {
+            splitLines(changes[k].text, newLines[k-i]);
+            newCount = newCount-(changes[k].last-changes[k].first)+newLines[k-i].size();
+        }
+        //by convention, empty ranges start at the line before them
+        out << "@@ -" << (oldCount>0 ? firstLine+begin+1 : firstLine+begin) << "," << oldCount << " +" << (newCount>0 ? firstLine+begin+delta+1 : firstLine+begin+delta) << "," << newCount << " @@\n";
+        unsigned line = begin;
+        for (size_t k = i; k < j; ++k) {
+            for (; line < changes[k].first; ++line) writeDiffLine(out, ' ', lines[line]);
+            for (; line < changes[k].last; ++line) writeDiffLine(out, '-', lines[line]);
+            for (StringRef newLine : newLines[k-i]) writeDiffLine(out, '+', newLine);
+        }
+        for (; line < end; ++line) writeDiffLine(out, ' ', lines[line]);
+        delta += (int)newCount-(int)oldCount;
+        i = j;
+    }
+}
+
+//offsets where the lines of contents start, followed by the end of the contents
+static void getLineStarts(StringRef contents, std::vector<unsigned> &starts) {
+    starts.assign(1, 0);
+    while (starts.back() < contents.size()) {
+        size_t eol = contents.find('\n', starts.back());
+        starts.push_back(eol==StringRef::npos ? contents.size() : eol+1);
+    }
+}
+
+//unified diff (with 3 lines of context) of applying edits to original contents that already have the previous edits applied. Both sets are
+//relative to original (whose lines start at starts, as given by getLineStarts), sorted, and do not overlap each other. Only the lines around
+//the edits are rebuilt (with the previous edits on them), so the cost depends on the edits, not on the size of the file
+static void writeUnifiedDiff(raw_ostream &out, StringRef path, StringRef original, const std::vector<unsigned> &starts,
+                             const std::vector<SourceEdit> &previous, const std::vector<SourceEdit> &edits) {
+    const unsigned context = 3;
+    if (edits.empty()) return;
+    unsigned numLines = starts.size()-1;
+    //both sets of edits in order, the new ones marked as such
+    std::vector<std::pair<const SourceEdit*, bool>> all;
+    std::vector<SourceEdit>::const_iterator p = previous.begin(), e = edits.begin();
+    while (p!=previous.end() || e!=edits.end()) {
+        if (e==edits.end() || (p!=previous.end() && p->offset<e->offset)) {
+            all.push_back(std::make_pair(&*p++, false));
+        } else {
+            all.push_back(std::make_pair(&*e++, true));
+        }
+    }
+    auto lineOf = [&](unsigned offset) -> unsigned {
+        unsigned line = std::upper_bound(starts.begin(), starts.end(), offset)-starts.begin()-1;
+        return line==numLines && numLines>0 && original.back()!='\n' ? numLines-1 : line;
+    };
+    auto lineAfter = [&](const SourceEdit &e) -> unsigned {
+        return e.length>0 ? lineOf(e.end()-1)+1 : std::min(lineOf(e.offset)+1, numLines);
+    };
+    //the first edit at or after the start of a line
+    auto editAt = [&](unsigned line) -> size_t {
+        return std::lower_bound(all.begin(), all.end(), starts[line], [](const std::pair<const SourceEdit*, bool> &a, unsigned offset) { return a.first->offset<offset; })-all.begin();
+    };
+    //the end of the edits before a line (appending to the end of the contents is before the end of the last line)
+    auto editBefore = [&](unsigned line) -> size_t { return line<numLines ? editAt(line) : all.size(); };
+    //the original lines [first, last) with the previous edits on them applied
+    auto rebuild = [&](unsigned first, unsigned last) -> std::string {
+        std::string text;
+        unsigned pos = starts[first];
+        for (size_t k = editAt(first), end = editBefore(last); k < end; ++k) {
+            if (all[k].second) continue;
+            text.append(original.data()+pos, all[k].first->offset-pos);
+            text += all[k].first->text;
+            pos = all[k].first->end();
+        }
+        text.append(original.data()+pos, starts[last]-pos);
+        return text;
+    };
+    auto countLines = [](StringRef text) -> unsigned { return text.count('\n')+(!text.empty() && text.back()!='\n' ? 1 : 0); };
+    auto lineShift = [&](const SourceEdit &e) -> int { return (int)StringRef(e.text).count('\n')-(int)original.substr(e.offset, e.length).count('\n'); };
+    //original lines [first, last) with the new edits [begin, end), and any previous edits on them, so their text with the previous edits
+    //applied starts at line oldFirst and has whole lines
+    struct Window {
+        unsigned first, last;
+        size_t begin, end;
+        unsigned oldFirst, oldCount;
+    };
+    std::vector<Window> windows;
+    //difference in line numbers between the original contents and the ones with the previous edits applied, up to the current edit
+    int shift = 0;
+    for (size_t i = 0; i < all.size();) {
+        if (!all[i].second) {
+            shift += lineShift(*all[i].first);
+            ++i;
+            continue;
+        }
+        Window w;
+        w.first = lineOf(all[i].first->offset);
+        w.last = lineAfter(*all[i].first);
+        w.begin = i;
+        size_t lowest = windows.empty() ? 0 : windows.back().end;
+        //previous edits that reach the first line (or its line terminator)
+        while (w.begin>lowest && (all[w.begin-1].first->offset>=starts[w.first] || (all[w.begin-1].first->length>0 && all[w.begin-1].first->end()>=starts[w.first]))) {
+            --w.begin;
+            w.first = lineOf(all[w.begin].first->offset);
+            shift -= lineShift(*all[w.begin].first);
+        }
+        w.oldFirst = w.first+shift;
+        w.end = i+1;
+        while (true) {
+            for (; w.end < all.size() && lineOf(all[w.end].first->offset)<w.last; ++w.end) {
+                w.last = std::max(w.last, lineAfter(*all[w.end].first));
+            }
+            std::vector<SourceEdit> inner;
+            for (size_t k = w.begin; k < w.end; ++k) {
+                inner.push_back(SourceEdit(all[k].first->offset-starts[w.first], all[k].first->length, all[k].first->text));
+            }
+            std::string newText = applyEdits(original.substr(starts[w.first], starts[w.last]-starts[w.first]), inner);
+            std::string oldText = rebuild(w.first, w.last);
+            //if the line terminator of the last line was removed, the next line is part of the window
+            if ((!oldText.empty() && oldText.back()!='\n') || (!newText.empty() && newText.back()!='\n')) {
+                if (w.last<numLines) {
+                    ++w.last;
+                    continue;
+                }
+                //appending to the end of the contents
+                if (w.end<all.size()) {
+                    w.end = all.size();
+                    continue;
+                }
+            }
+            w.oldCount = countLines(oldText);
+            break;
+        }
+        for (size_t k = w.begin; k < w.end; ++k) {
+            if (!all[k].second) shift += lineShift(*all[k].first);
+        }
+        i = w.end;
+        windows.push_back(w);
+    }
+    out << "--- " << path << "\n+++ " << path << "\n";
+    int delta = 0;
+    //windows closer than twice the context may end up in the same hunk, so they are diffed together, with the lines between them
+    for (size_t i = 0; i < windows.size();) {
+        size_t j = i+1;
+        for (; j < windows.size() && windows[j].oldFirst-(windows[j-1].oldFirst+windows[j-1].oldCount)<=2*context; ++j) {}
+        //enough lines before and after them for the context, without splitting the previous edits
+        unsigned first = windows[i].first;
+        std::string leading;
+        while (first>0 && countLines(leading)<context) {
+            --first;
+            size_t k = editAt(first);
+            while (k>0 && all[k-1].first->length>0 && all[k-1].first->end()>=starts[first]) {
+                first = lineOf(all[k-1].first->offset);
+                k = editAt(first);
+            }
+            leading = rebuild(first, windows[i].first);
+        }
+        unsigned last = windows[j-1].last;
+        for (unsigned trailing = 0; last<numLines && trailing<context;) {
+            ++last;
+            for (size_t k = editAt(last); k>0 && all[k-1].first->end()>starts[last]; k = editAt(last)) {
+                last = lineAfter(*all[k-1].first);
+            }
+            std::string text = rebuild(windows[j-1].last, last);
+            trailing = !text.empty() && text.back()!='\n' ? 0 : countLines(text);
+        }
+        std::string contents = rebuild(first, last);
+        //the new edits, relative to contents
+        std::vector<SourceEdit> local;
+        int offsetShift = -(int)starts[first];
+        for (size_t k = editAt(first), end = editBefore(last); k < end; ++k) {
+            if (all[k].second) {
+                if (k<windows[i].begin || k>=windows[j-1].end) continue;
+                local.push_back(SourceEdit(all[k].first->offset+offsetShift, all[k].first->length, all[k].first->text));
+            } else {
+                offsetShift += (int)all[k].first->text.size()-(int)all[k].first->length;
+            }
+        }
+        writeHunks(out, contents, local, windows[i].oldFirst-countLines(leading), delta);
+        i = j;
+    }
+}
+
+//edits on contents, followed by edits on the result (mid), as edits on contents. Edits of both sets that touch each other are fused
+static std::vector<SourceEdit> composeEdits(StringRef mid, const std::vector<SourceEdit> &first, const std::vector<SourceEdit> &second) {
+    //ranges of the edits of both sets in the coordinates of mid
+    struct Span {
+        unsigned start, end;
+        const SourceEdit *edit;
+        bool isFirst;
+    };
+    std::vector<Span> spans;
+    int shift = 0;
+    for (const SourceEdit &e : first) {
+        Span s = {e.offset+shift, (unsigned)(e.offset+shift+e.text.size()), &e, true};
+        spans.push_back(s);
+        shift += (int)e.text.size()-(int)e.length;
+    }
+    for (const SourceEdit &e : second) {
+        Span s = {e.offset, e.end(), &e, false};
+        spans.push_back(s);
+    }
+    std::stable_sort(spans.begin(), spans.end(), [](const Span &a, const Span &b) { return a.start<b.start; });
+    std::vector<SourceEdit> result;
+    //difference between offsets in mid and in contents, before the current span
+    int delta = 0;
+    for (size_t i = 0; i < spans.size();) {
+        unsigned start = spans[i].start, end = spans[i].end;
+        size_t j = i+1;
+        for (; j < spans.size() && spans[j].start<=end; ++j) {
+            end = std::max(end, spans[j].end);
+        }
+        int fusedDelta = 0;
+        std::vector<SourceEdit> inner;
+        for (size_t k = i; k < j; ++k) {
+            const SourceEdit &e = *spans[k].edit;
+            if (spans[k].isFirst) {
+                fusedDelta += (int)e.text.size()-(int)e.length;
+            } else {
+                inner.push_back(SourceEdit(e.offset-start, e.length, e.text));
+            }
+        }
+        result.push_back(SourceEdit(start-delta, end-start-fusedDelta, applyEdits(mid.substr(start, end-start), inner)));
+        delta += fusedDelta;
+        i = j;
+    }
+    return result;
+}
+
+//ranges of subexpressions and the text for each one, see EditCollector::getRewrittenText()
+typedef std::vector<std::pair<SourceRange, std::string>> TextReplacements;
+
+//Drop-in replacement for the parts of clang::Rewriter used by RefactorEngine. Instead of rewriting buffers, it records the edits in
+//the coordinates of the original files, so edits from different translation units can be merged and each file written just once.
+//Like Rewriter, the edit methods return true if the edit could not be done, and an edit enclosing previous edits supersedes them
+class EditCollector {
+    SourceManager *SourceMgr;
+    const LangOptions *LangOpts;
+    std::map<FileID, std::vector<SourceEdit>> edits;
+
+    //true if x is before any edit starting at offset (a zero-length edit at the same offset is not)
+    static bool endsBefore(const SourceEdit &x, unsigned offset) { return x.end()<=offset && !(x.length==0 && x.offset==offset); }
+
+    bool addEdit(FileID FID, const SourceEdit &e) {
+        return insertEdit(edits[FID], FID, e);
+    }
+
+public:
+    EditCollector() : SourceMgr(NULL), LangOpts(NULL) {}
+
+    void setSourceMgr(SourceManager &SM, const LangOptions &LO) { SourceMgr = &SM; LangOpts = &LO; edits.clear(); }
+    SourceManager &getSourceMgr() const { return *SourceMgr; }
+    const LangOptions &getLangOpts() const { return *LangOpts; }
+
+    //same conventions as Rewriter::getRangeSize(): the end of the range is the start of the last token
+    bool getCharRange(SourceRange range, FileID &FID, unsigned &offset, unsigned &length) const {
+        SourceLocation B = range.getBegin(), E = range.getEnd();
+        if (!B.isFileID() || !E.isFileID()) return false;
+        std::pair<FileID, unsigned> b = SourceMgr->getDecomposedLoc(B);
+        std::pair<FileID, unsigned> e = SourceMgr->getDecomposedLoc(E);
+        if (b.first!=e.first) return false;
+        unsigned endOffset = e.second + Lexer::MeasureTokenLength(E, *SourceMgr, *LangOpts);
+        if (endOffset<b.second) return false;
+        FID = b.first;
+        offset = b.second;
+        length = endOffset-b.second;
+        return true;
+    }
+
+    //the rules of Rewriter for a new edit, on the sorted edits v of the file FID (either all of them, or a copy of some of them, see
+    //RefactorEngine::rewriteIfStmts())
+    bool insertEdit(std::vector<SourceEdit> &v, FileID FID, const SourceEdit &e) const {
+        auto first = std::lower_bound(v.begin(), v.end(), e.offset, endsBefore);
+        auto last = first;
+        for (; last!=v.end() && (last->offset<e.end() || last->offset==e.offset); ++last) {
+            if (*last==e) return false;
+            if (!e.contains(*last)) {
+                if (last->contains(e) && last->text.empty()) {
+                    //this text has already been removed
+                    return false;
+                }
+                const FileEntry *entry = SourceMgr->getFileEntryForID(FID);
+                llvm::errs() << "WARNING: overlapping edits in " << (entry ? entry->getName() : StringRef("<unknown>")) << " at offsets " << last->offset << " and " << e.offset << ", ignoring the second one\n";
+                return true;
+            }
+        }
+        first = v.erase(first, last);
+        v.insert(first, e);
+        return false;
+    }
+
+    //the edits made so far that an edit of the range would supersede
+    void getEditsInside(FileID FID, unsigned offset, unsigned length, std::vector<SourceEdit> &inside) const {
+        auto it = edits.find(FID);
+        if (it==edits.end()) return;
+        const std::vector<SourceEdit> &v = it->second;
+        for (auto e = std::lower_bound(v.begin(), v.end(), offset, endsBefore); e!=v.end() && (e->offset<offset+length || e->offset==offset); ++e) {
+            if (e->offset>=offset && e->end()<=offset+length) {
+                inside.push_back(*e);
+            }
+        }
+    }
+
+    bool RemoveText(SourceLocation start, unsigned length) {
+        if (!start.isFileID()) return true;
+        std::pair<FileID, unsigned> s = SourceMgr->getDecomposedLoc(start);
+        return addEdit(s.first, SourceEdit(s.second, length, ""));
+    }
+
+    bool RemoveText(SourceRange range) { return ReplaceText(range, ""); }
+
+    bool ReplaceText(SourceLocation start, unsigned length, StringRef text) {
+        if (!start.isFileID()) return true;
+        std::pair<FileID, unsigned> s = SourceMgr->getDecomposedLoc(start);
+        return addEdit(s.first, SourceEdit(s.second, length, text));
+    }
+
+    bool ReplaceText(SourceRange range, StringRef text) {
+        FileID FID;
+        unsigned offset, length;
+        if (!getCharRange(range, FID, offset, length)) return true;
+        return addEdit(FID, SourceEdit(offset, length, text));
+    }
+
+    //text of the range with the given subranges (in order, without overlaps) replaced, after applying the edits in the rest of it.
+    //False if the ranges are not all in the same file
+    bool getRewrittenText(SourceRange range, const TextReplacements &replacements, std::string &text) const {
+        FileID FID;
+        unsigned offset, length;
+        if (!getCharRange(range, FID, offset, length)) return false;
+        text.clear();
+        unsigned pos = offset;
+        for (const std::pair<SourceRange, std::string> &r : replacements) {
+            FileID rFID;
+            unsigned rOffset, rLength;
+            if (!getCharRange(r.first, rFID, rOffset, rLength) || rFID!=FID || rOffset<pos || rOffset+rLength>offset+length) return false;
+            text += getRewrittenText(FID, pos, rOffset-pos);
+            text += r.second;
+            pos = rOffset+rLength;
+        }
+        text += getRewrittenText(FID, pos, offset+length-pos);
+        return true;
+    }
+
+    //text of the range after applying the edits inside it
+    std::string getRewrittenText(FileID FID, unsigned offset, unsigned length) const {
+        StringRef buffer = SourceMgr->getBufferData(FID).substr(offset, length);
+        std::vector<SourceEdit> inside;
+        auto it = edits.find(FID);
+        if (it!=edits.end()) {
+            for (const SourceEdit &e : it->second) {
+                if (e.offset>=offset && e.end()<=offset+length) {
+                    inside.push_back(SourceEdit(e.offset-offset, e.length, e.text));
+                }
+            }
+        }
+        return applyEdits(buffer, inside);
+    }
+
+    //the edits of this translation unit, one FileEdits for each FileID with edits, with absolute paths (so they do not depend on the working directory).
+    //Edits that leave the text as it was are dropped
+    void getFileEdits(std::vector<FileEdits> &out) const {
+        for (auto &fileAndEdits : edits) {
+            const FileEntry *entry = SourceMgr->getFileEntryForID(fileAndEdits.first);
+            if (!entry) continue;
+            StringRef buffer = SourceMgr->getBufferData(fileAndEdits.first);
+            FileEdits fe;
+            for (const SourceEdit &e : fileAndEdits.second) {
+                if (buffer.substr(e.offset, e.length)!=e.text) {
+                    fe.edits.push_back(e);
+                }
+            }
+            if (fe.edits.empty()) continue;
+            fe.path = getCanonicalPath(entry->getName());
+            fe.hash = hashContents(buffer);
+            out.push_back(std::move(fe));
+        }
+    }
+};
+
 class RefactorEngine {
-    Rewriter *Rewrite;
+    EditCollector *Edits;
     SourceManager *SourceMgr;
-    const SrcMgr::ContentCache * Content;
     StringRef fileBuffer;
     FileID FID;
-    const FileEntry * fileEntry;
+    //locations in FID are just offsets from the start of the file
+    SourceLocation fileStart;
+    //offsets of the starts of the lines of FID, used for all line lookups
+    const std::vector<unsigned> *lineOffsets;
+    std::map<FileID, std::vector<unsigned>> lineTables;
     bool computed;
+    //an if statement given to simpleRefactorIfStmt(): the removals that rewrite it, as offsets in its file, and the range they span
+    struct PendingIf {
+        FileID FID;
+        unsigned start, end;
+        std::vector<SourceEdit> parts;
+    };
+    std::vector<PendingIf> pendingIfs;
     
     void recompute(SourceLocation loc) {
         FileID f(SourceMgr->getFileID(loc));
         if (!computed || f!=FID) {
             computed = true;
             FID = f;
-            fileEntry = SourceMgr->getFileEntryForID(FID);
-            Content = SourceMgr->getSLocEntry(FID).getFile().getContentCache();
+            fileStart = SourceMgr->getLocForStartOfFile(FID);
             fileBuffer = SourceMgr->getBufferData(FID);
+            std::vector<unsigned> &table = lineTables[FID];
+            if (table.empty()) {
+                //same line endings as SourceManager: \n, \r, \r\n and \n\r
+                table.push_back(0);
+                for (unsigned i = 0; i < fileBuffer.size(); ++i) {
+                    char c = fileBuffer[i];
+                    if (c=='\n' || c=='\r') {
+                        if (i+1<fileBuffer.size() && (fileBuffer[i+1]=='\n' || fileBuffer[i+1]=='\r') && fileBuffer[i+1]!=c) ++i;
+                        table.push_back(i+1);
+                    }
+                }
+            }
+            lineOffsets = &table;
         }
     }
     
-    //alternative implementation of SourceManager::getComposedLoc() (cannot backport because the original uses private methods), probably more expensive
-    SourceLocation getComposedLoc(FileID FID, unsigned Offset) const {
-        //return SourceMgr->getComposedLoc(FID, Offset);
-        unsigned line = SourceMgr->getLineNumber(FID, Offset);
-        unsigned column = SourceMgr->getColumnNumber(FID, Offset);
-        return SourceMgr->translateFileLineCol(fileEntry, line, column);
+    //same as SourceManager::getComposedLoc() for the current file
+    SourceLocation getComposedLoc(unsigned Offset) const {
+        return fileStart.getLocWithOffset(Offset);
     }
   
     IndentRange getIndentRange(unsigned lineNumber) {
-        unsigned lineOffs = Content->SourceLineCache[lineNumber-1];
+        unsigned lineOffs = (*lineOffsets)[lineNumber-1];
         unsigned i = lineOffs;
-        while (isWhitespaceExceptNL(fileBuffer[i])) ++i;
+        while (i<fileBuffer.size() && isWhitespaceExceptNL(fileBuffer[i])) ++i;
         return IndentRange(lineOffs, i-lineOffs);
     }
     
@@ -85,12 +780,27 @@ class RefactorEngine {
     }
 
     unsigned getLine(SourceLocation loc) {
-        return SourceMgr->getLineNumber(FID, SourceMgr->getFileOffset(loc));
+        unsigned offset = SourceMgr->getFileOffset(loc);
+        return std::upper_bound(lineOffsets->begin(), lineOffsets->end(), offset) - lineOffsets->begin();
     }
     
-    IndentRange reindentBranch(const IfStmt *IfS, const Stmt *branch) {
+    //a removal in the current file, for the rewriting of an if statement. Like the edit methods, it is not done for locations in macros
+    void removePart(std::vector<SourceEdit> &parts, SourceLocation start, unsigned length) {
+        if (start.isFileID() && SourceMgr->getFileID(start)==FID) {
+            parts.push_back(SourceEdit(SourceMgr->getFileOffset(start), length, ""));
+        }
+    }
+
+    void removePart(std::vector<SourceEdit> &parts, SourceRange range) {
+        FileID f;
+        unsigned offset, length;
+        if (Edits->getCharRange(range, f, offset, length) && f==FID) {
+            parts.push_back(SourceEdit(offset, length, ""));
+        }
+    }
+
+    IndentRange reindentBranch(const IfStmt *IfS, const Stmt *branch, std::vector<SourceEdit> &parts) {
         SourceLocation ifLoc = IfS->getIfLoc();
-        recompute(ifLoc);
         unsigned ifLine = getLine(ifLoc);
         IndentRange ifIndentRange = getIndentRange(ifLine);
         int lenIfIndent = ifIndentRange.size;
@@ -101,23 +811,13 @@ class RefactorEngine {
             int lenIndent = indentRange.size;
             int lenToRemove = lenIndent-lenIfIndent;
             if (lenToRemove>0) {
-                Rewrite->RemoveText(getComposedLoc(FID, indentRange.end()-lenToRemove), lenToRemove);
+                removePart(parts, getComposedLoc(indentRange.end()-lenToRemove), lenToRemove);
             }
         }
         return ifIndentRange;
     }
-    
-public:
-    RefactorEngine() : computed(false) {}
-
-    void setRewriter(Rewriter *R) { Rewrite = R; SourceMgr = &R->getSourceMgr(); computed = false; }
-    
-    void showLine(const SourceLocation loc) {
-        recompute(loc);
-        llvm::errs() << "LINE: <" << getLine(loc) << " in " << FID.getHashValue() << ">\n";
-    }
 
-    void simpleRefactorIfStmt(const IfStmt *IfS, bool value) {
+    void getIfStmtParts(const IfStmt *IfS, bool value, std::vector<SourceEdit> &parts) {
         //const Expr *cond = IfS->getCond();
         const Stmt *Then = IfS->getThen();
         const Stmt *Else = IfS->getElse();
@@ -126,17 +826,17 @@ public:
             const Stmt &branchR = *branch;
             bool compound = isa<CompoundStmt>(branchR);
             //the if keyword's indent range might be handy later
-            IndentRange ifIndentRange = reindentBranch(IfS, branch);
+            IndentRange ifIndentRange = reindentBranch(IfS, branch, parts);
             if (value) {
-                Rewrite->RemoveText(SourceRange(IfS->getIfLoc(), Then->getLocStart().getLocWithOffset(-1)));
-                Rewrite->RemoveText(SourceRange(Then->getLocEnd().getLocWithOffset(1), IfS->getLocEnd()));
+                removePart(parts, SourceRange(IfS->getIfLoc(), Then->getLocStart().getLocWithOffset(-1)));
+                removePart(parts, SourceRange(Then->getLocEnd().getLocWithOffset(1), IfS->getLocEnd()));
             } else {
-                Rewrite->RemoveText(SourceRange(IfS->getIfLoc(), Else->getLocStart().getLocWithOffset(-1)));
+                removePart(parts, SourceRange(IfS->getIfLoc(), Else->getLocStart().getLocWithOffset(-1)));
             }
             if (compound) {
                 const CompoundStmt &branchC = cast<CompoundStmt>(branchR);
-                Rewrite->RemoveText(branchC.getLBracLoc(), 1);
-                Rewrite->RemoveText(branchC.getRBracLoc(), 1);
+                removePart(parts, branchC.getLBracLoc(), 1);
+                removePart(parts, branchC.getRBracLoc(), 1);
             } else if (ifIndentRange.size>0){
                 /* At least in branches of conditional statements, clang treats the whitespace before simple
                 * statements as part of them, while compound statements just ignore whitespace. The unpleasant
@@ -144,333 +844,3445 @@ public:
                 * working purely from the AST, as simple statements have one indelible whitespace character.
                 * This is a hack to get decent indentation for simple statements, most of the time, provided
                 * there are no inconvenient tabs within the whitespace. */
-                Rewrite->RemoveText(getComposedLoc(FID, ifIndentRange.end()-1), 1);
+                removePart(parts, getComposedLoc(ifIndentRange.end()-1), 1);
             }
         } else {
-            Rewrite->RemoveText(IfS->getSourceRange());
+            removePart(parts, IfS->getSourceRange());
+        }
+    }
+    
+public:
+    RefactorEngine() : lineOffsets(NULL), computed(false) {}
+
+    void setEditCollector(EditCollector *E) { Edits = E; SourceMgr = &E->getSourceMgr(); computed = false; lineTables.clear(); pendingIfs.clear(); }
+    
+    void showLine(const SourceLocation loc) {
+        recompute(loc);
+        llvm::errs() << "LINE: <" << getLine(loc) << " in " << FID.getHashValue() << ">\n";
+    }
+
+    //the reindentation of each line of the branch, and the removal of the keywords, the condition, the other branch and the braces are
+    //written as a single edit for the whole if statement by rewriteIfStmts(), instead of tens of thousands of small ones for long branches
+    void simpleRefactorIfStmt(const IfStmt *IfS, bool value) {
+        //the text of an if statement written by a macro is not in the file
+        if (!IfS->getIfLoc().isFileID()) return;
+        recompute(IfS->getIfLoc());
+        PendingIf pending;
+        pending.FID = FID;
+        getIfStmtParts(IfS, value, pending.parts);
+        if (pending.parts.empty()) return;
+        pending.start = pending.parts[0].offset;
+        pending.end = pending.parts[0].end();
+        for (const SourceEdit &part : pending.parts) {
+            pending.start = std::min(pending.start, part.offset);
+            pending.end = std::max(pending.end, part.end());
+        }
+        pendingIfs.push_back(std::move(pending));
+    }
+
+    //write the if statements given to simpleRefactorIfStmt(). This is done once all the other edits of the translation unit have been
+    //made, so the new text of each if statement is built from the text with those edits. Nested if statements are written along with the
+    //outermost one, with their removals applied in the order they were given, as if each one had been an edit on its own
+    void rewriteIfStmts() {
+        std::vector<size_t> order(pendingIfs.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+            const PendingIf &x = pendingIfs[a], &y = pendingIfs[b];
+            return x.FID<y.FID || (x.FID==y.FID && x.start<y.start);
+        });
+        for (size_t i = 0; i < order.size();) {
+            FileID f = pendingIfs[order[i]].FID;
+            unsigned start = pendingIfs[order[i]].start, end = pendingIfs[order[i]].end;
+            size_t j = i+1;
+            for (; j < order.size() && pendingIfs[order[j]].FID==f && pendingIfs[order[j]].start<end; ++j) {
+                end = std::max(end, pendingIfs[order[j]].end);
+            }
+            std::sort(order.begin()+i, order.begin()+j);
+            std::vector<SourceEdit> before, edits;
+            Edits->getEditsInside(f, start, end-start, before);
+            edits = before;
+            for (size_t k = i; k < j; ++k) {
+                for (const SourceEdit &part : pendingIfs[order[k]].parts) {
+                    //text already rewritten (such as a folded expression spanning several lines) is kept as it is
+                    auto next = std::upper_bound(before.begin(), before.end(), part.offset, [](unsigned offset, const SourceEdit &e) { return offset<e.offset; });
+                    if (next!=before.begin() && (next-1)->contains(part)) continue;
+                    Edits->insertEdit(edits, f, part);
+                }
+            }
+            for (SourceEdit &e : edits) {
+                e.offset -= start;
+            }
+            std::string text = applyEdits(SourceMgr->getBufferData(f).substr(start, end-start), edits);
+            Edits->ReplaceText(SourceMgr->getLocForStartOfFile(f).getLocWithOffset(start), end-start, text);
+            i = j;
         }
+        pendingIfs.clear();
+    }
+
+    bool simpleReplaceExpr(const Stmt *expr, StringRef value) {
+        return Edits->ReplaceText(expr->getSourceRange(), value);
     }
 
-    void simpleReplaceExpr(const Stmt *expr, StringRef value) {
-        Rewrite->ReplaceText(expr->getSourceRange(), value);
+    //remove a statement or a declaration, and the semicolon after it if it is not part of its range. If nothing else is written in its
+    //lines, the lines are removed as well. Like the edit methods, it returns true if it could not be done
+    bool removeStmtOrDecl(SourceRange range, bool withSemicolon) {
+        SourceLocation B = range.getBegin(), E = range.getEnd();
+        if (!B.isFileID() || !E.isFileID()) return true;
+        const LangOptions &LangOpts = Edits->getLangOpts();
+        unsigned end;
+        if (withSemicolon) {
+            E = Lexer::findLocationAfterToken(E, tok::semi, *SourceMgr, LangOpts, false);
+            if (E.isInvalid()) return true;
+            end = SourceMgr->getFileOffset(E);
+        } else {
+            end = SourceMgr->getFileOffset(E) + Lexer::MeasureTokenLength(E, *SourceMgr, LangOpts);
+        }
+        recompute(B);
+        if (SourceMgr->getFileID(E)!=FID) return true;
+        unsigned start = SourceMgr->getFileOffset(B);
+        IndentRange indent = getIndentRange(getLine(B));
+        unsigned lineEnd = end;
+        while (lineEnd<fileBuffer.size() && isWhitespaceExceptNL(fileBuffer[lineEnd])) ++lineEnd;
+        if (indent.start+indent.size==start && (lineEnd==fileBuffer.size() || fileBuffer[lineEnd]=='\n')) {
+            start = indent.start;
+            end = std::min<unsigned>(lineEnd+1, fileBuffer.size());
+        }
+        return Edits->RemoveText(getComposedLoc(start), end-start);
     }
 
-    void simpleReplaceExpr(const Stmt *expr, const Stmt *newexpr) {
-        Rewrite->ReplaceText(expr->getSourceRange(), newexpr->getSourceRange());
+    //text of the expression after the edits made so far, with some of its subexpressions replaced
+    bool getRewrittenText(const Stmt *expr, const TextReplacements &replacements, std::string &text) {
+        return Edits->getRewrittenText(expr->getSourceRange(), replacements, text);
     }
 
 };
 
-//Result type for MatchHandler::simplePartialEvaluation
-typedef struct CondResult {
-    bool replaceByBool, val;
-    const Stmt *sub, *newval;
-    CondResult(const Stmt *s, bool v)       : replaceByBool(true),  val(v), sub(s) {}
-    CondResult(const Stmt *s, const Stmt *n): replaceByBool(false), sub(s), newval(n) {}
-} CondResult;
+//precedence of C++ operators, from the loosest to the tightest binding. The conditional operator is at the same level as assignments
+enum Precedence {PrecComma, PrecAssignment, PrecLogicalOr, PrecLogicalAnd, PrecBitOr, PrecBitXor, PrecBitAnd, PrecEquality, PrecRelational,
+                 PrecShift, PrecAdditive, PrecMultiplicative, PrecPointerToMember, PrecUnary, PrecPostfix, PrecPrimary};
+
+//false for operators without a level here (the three-way comparison)
+static bool getBinaryPrecedence(BinaryOperatorKind op, Precedence &prec) {
+    switch (op) {
+        case BO_PtrMemD: case BO_PtrMemI:           prec = PrecPointerToMember; return true;
+        case BO_Mul: case BO_Div: case BO_Rem:      prec = PrecMultiplicative;  return true;
+        case BO_Add: case BO_Sub:                   prec = PrecAdditive;        return true;
+        case BO_Shl: case BO_Shr:                   prec = PrecShift;           return true;
+        case BO_LT: case BO_GT: case BO_LE: case BO_GE: prec = PrecRelational;  return true;
+        case BO_EQ: case BO_NE:                     prec = PrecEquality;        return true;
+        case BO_And:                                prec = PrecBitAnd;          return true;
+        case BO_Xor:                                prec = PrecBitXor;          return true;
+        case BO_Or:                                 prec = PrecBitOr;           return true;
+        case BO_LAnd:                               prec = PrecLogicalAnd;      return true;
+        case BO_LOr:                                prec = PrecLogicalOr;       return true;
+        case BO_Comma:                              prec = PrecComma;           return true;
+        default:
+            prec = PrecAssignment;
+            return BinaryOperator::isAssignmentOp(op);
+    }
+}
+
+static const Expr *ignoreParensAndImplicit(const Expr *e) {
+    while (true) {
+        const Expr *next = e->IgnoreImplicit()->IgnoreParens();
+        if (next==e) return e;
+        e = next;
+    }
+}
+
+//precedence of the outermost operator of the expression, as written. Overloaded operators are taken as the loosest binding ones
+static Precedence getPrecedence(const Expr *e) {
+    e = e->IgnoreImplicit();
+    Precedence prec;
+    if (isa<BinaryOperator>(e)) {
+        return getBinaryPrecedence(cast<BinaryOperator>(e)->getOpcode(), prec) ? prec : PrecComma;
+    }
+    if (isa<CXXOperatorCallExpr>(e)) {
+        return cast<CXXOperatorCallExpr>(e)->getOperator()==OO_Call || cast<CXXOperatorCallExpr>(e)->getOperator()==OO_Subscript ? PrecPostfix : PrecComma;
+    }
+    if (isa<AbstractConditionalOperator>(e) || isa<CXXThrowExpr>(e)) return PrecAssignment;
+    if (isa<UnaryOperator>(e)) return cast<UnaryOperator>(e)->isPostfix() ? PrecPostfix : PrecUnary;
+    if (isa<CStyleCastExpr>(e) || isa<UnaryExprOrTypeTraitExpr>(e) || isa<CXXNewExpr>(e) || isa<CXXDeleteExpr>(e)) return PrecUnary;
+    if (isa<CallExpr>(e) || isa<MemberExpr>(e) || isa<ArraySubscriptExpr>(e) || isa<CXXNamedCastExpr>(e) || isa<CXXFunctionalCastExpr>(e)) return PrecPostfix;
+    return PrecPrimary;
+}
+
+//lowest precedence that the operand of an expression can have to go without parentheses
+static Precedence getOperandPrecedence(const Expr *parent, const Expr *operand) {
+    Precedence prec;
+    if (isa<BinaryOperator>(parent)) {
+        const BinaryOperator *o = cast<BinaryOperator>(parent);
+        if (!getBinaryPrecedence(o->getOpcode(), prec)) return PrecPrimary;
+        if (o->isAssignmentOp()) return operand==o->getLHS() ? PrecUnary : PrecAssignment;
+        if (o->getOpcode()==BO_Comma) return operand==o->getLHS() ? PrecComma : PrecAssignment;
+        //left associative, except for && and ||, which are associative anyway
+        return operand==o->getLHS() || o->isLogicalOp() ? prec : Precedence(prec+1);
+    }
+    if (isa<ConditionalOperator>(parent)) {
+        const ConditionalOperator *o = cast<ConditionalOperator>(parent);
+        return operand==o->getCond() ? PrecLogicalOr : operand==o->getTrueExpr() ? PrecComma : PrecAssignment;
+    }
+    if (isa<UnaryOperator>(parent)) return cast<UnaryOperator>(parent)->isPostfix() ? PrecPostfix : PrecUnary;
+    if (isa<CStyleCastExpr>(parent)) return PrecUnary;
+    if (isa<ParenExpr>(parent)) return PrecComma;
+    if (isa<CallExpr>(parent) && !isa<CXXOperatorCallExpr>(parent)) return operand==cast<CallExpr>(parent)->getCallee() ? PrecPostfix : PrecAssignment;
+    if (isa<CXXConstructExpr>(parent) || isa<InitListExpr>(parent) || isa<CXXFunctionalCastExpr>(parent)) return PrecAssignment;
+    if (isa<MemberExpr>(parent)) return PrecPostfix;
+    if (isa<ArraySubscriptExpr>(parent)) return operand==cast<ArraySubscriptExpr>(parent)->getIdx() ? PrecComma : PrecPostfix;
+    //anything else: parentheses, just in case
+    return PrecPrimary;
+}
+
+static std::string parenthesize(const std::string &text, Precedence prec, Precedence context) {
+    return prec<context ? "(" + text + ")" : text;
+}
 
 //Result type for MatchHandler::getUseCase
 enum ParentType {ParentUnknown, ParentIf, ParentCE, ParentAssignmentRHS, ParentVarDecl, ParentNonSpecial};
 typedef struct ParentUseCase {
     ParentType type;
-    const Stmt *parent;
-    const Expr *cond;
-    ParentUseCase() : type(ParentUnknown), parent(NULL), cond(NULL) {}
-    ParentUseCase(ParentType t, const Stmt *s) : type(t), parent(s), cond(NULL) {}
-    ParentUseCase(ParentType t, const Stmt *s, const Expr *e) : type(t), parent(s), cond(e) {}
+    //the expression folded as a whole, or NULL if the use case is not handled
+    const Expr *root;
+    //the if statement whose condition is root, if any
+    const IfStmt *ifStmt;
+    //lowest precedence the text replacing root can have without parentheses
+    Precedence context;
+    ParentUseCase() : type(ParentUnknown), root(NULL), ifStmt(NULL), context(PrecPrimary) {}
+    ParentUseCase(ParentType t, const Expr *r, Precedence c) : type(t), root(r), ifStmt(NULL), context(c) {}
 } ParentUseCase;
 
-class MatchHandler : public MatchFinder::MatchCallback {
-public:
-    MatchHandler(RefactorEngine *r, std::string _literal) : refactorTool(r), literal(_literal) {}
-
-    void setContext(ASTContext *c) { context = c; }
-
-    virtual void run(const MatchFinder::MatchResult &Result) {
-        ASTContext *Context = Result.Context;
-        const StringLiteral *lit = Result.Nodes.getNodeAs<clang::StringLiteral>("strLiteral");
-        bool isLit = lit && lit->getString().str() == literal;
-        if (!isLit) return;
-
-        const CallExpr *config = Result.Nodes.getNodeAs<CallExpr>("callToConfigFunction");
-        ParentUseCase p = getUseCase(cast<Stmt>(config));
-
-        if (p.type==ParentIf || p.type==ParentCE) {
-            CondResult res = simplePartialEvaluation(config, TermValue.getValue(), p.cond);
-            if (res.replaceByBool) {
-                if (res.sub == p.cond) {
-                    if (p.type==ParentIf) {
-                        refactorTool->simpleRefactorIfStmt(cast<IfStmt>(p.parent), res.val);
-                    } else {
-                        //because of the very low precedence of the conditional operator, it is mostly safe to discard possible parentheses here
-                        const ConditionalOperator * CdE = cast<ConditionalOperator>(p.parent);
-                        refactorTool->simpleReplaceExpr(p.parent, getExprIgnoreParensAndImpCasts(res.val ? CdE->getLHS() : CdE->getRHS()));
-                    }
-                } else {
-                    refactorTool->simpleReplaceExpr(res.sub, res.val ? "true" : "false");
-                }
-            } else {
-                //TODO: parentheses might be necessary after this rewriting; for example: UNRELATEDCONDITION && CONFIG && (A || B).
-                //      Ideally, we should add/remove them as necessary, taking into account the relative precedences of the ancestor and children
-                //      Meanwhile, this is a crude approximation to remove them if it seems safe to do so
-                const Expr *condNoParens = getExprIgnoreParensAndImpCasts(p.cond);
-                if (cast<Expr>(res.sub)==condNoParens) {
-                    res.sub = p.cond;
-                    res.newval = cast<Stmt>(getExprIgnoreParensAndImpCasts(cast<Expr>(res.newval)));
-                }
-                refactorTool->simpleReplaceExpr(res.sub, res.newval);
-            }
-        } else if (p.type==ParentAssignmentRHS || (p.type==ParentNonSpecial && isa<Expr>(p.parent))) {
-            //TODO: when p.type==ParentAssignmentRHS, instead of this crude replacement, do further processing (out of the scope of this function):
-            //      if the variable is not used before this assignment, and there are no side effects, it can be removed, and its instances replaced by its value
-            //      (of course, the variable being assigned has to be captured in getUseCase()
-            const Expr * ep = cast<Expr>(p.parent);
-            CondResult res = simplePartialEvaluation(config, TermValue.getValue(), ep);
-            if (res.replaceByBool) {
-                refactorTool->simpleReplaceExpr(res.sub, res.val ? "true" : "false");
-            } else {
-                //TODO: same as above pattern
-                const Expr *condNoParens = getExprIgnoreParensAndImpCasts(ep);
-                if (cast<Expr>(res.sub)==condNoParens) {
-                    res.sub = ep;
-                    res.newval = cast<Stmt>(getExprIgnoreParensAndImpCasts(cast<Expr>(res.newval)));
-                }
-                refactorTool->simpleReplaceExpr(res.sub, res.newval);
+//the string literal that is the first argument of a call to a config function, looking through parentheses, implicit casts and conversions
+//to std::string (but not through anything else, such as concatenations), or NULL if there is none
+static const StringLiteral *getTermLiteral(const CallExpr *call) {
+    if (call->getNumArgs()==0) return NULL;
+    const Expr *e = call->getArg(0);
+    while (true) {
+        if (isa<ParenExpr>(e)) {
+            e = cast<ParenExpr>(e)->getSubExpr();
+        } else if (isa<ImplicitCastExpr>(e) || isa<CXXFunctionalCastExpr>(e)) {
+            e = cast<CastExpr>(e)->getSubExpr();
+        } else if (isa<MaterializeTemporaryExpr>(e)) {
+            e = cast<MaterializeTemporaryExpr>(e)->GetTemporaryExpr();
+        } else if (isa<CXXBindTemporaryExpr>(e)) {
+            e = cast<CXXBindTemporaryExpr>(e)->getSubExpr();
+        } else if (isa<ExprWithCleanups>(e)) {
+            e = cast<ExprWithCleanups>(e)->getSubExpr();
+        } else if (isa<CXXConstructExpr>(e)) {
+            //converting constructor: just one argument, plus default ones
+            const CXXConstructExpr *ce = cast<CXXConstructExpr>(e);
+            if (ce->getNumArgs()==0) return NULL;
+            for (unsigned i = 1; i < ce->getNumArgs(); ++i) {
+                if (!isa<CXXDefaultArgExpr>(ce->getArg(i))) return NULL;
             }
+            e = ce->getArg(0);
+        } else {
+            break;
         }
     }
+    const StringLiteral *lit = dyn_cast<StringLiteral>(e);
+    return lit!=NULL && lit->getCharByteWidth()==1 ? lit : NULL;
+}
 
-    //crude function to discriminate different use cases. For each one we recognize, we try to provide the best superexpression containing
-    //the call to the config function, such that rewriting can be most optimized (i.e. redundant parentheses can be automatically discarded)
-    ParentUseCase getUseCase(const Stmt *expr) {
-        const Stmt *e = expr;
-        //TODO: detect instances used in declarations / assignments to boolean variables/members.
-        //      If doing so, further processing (out of the scope of this function): 
-        while (!isa<CompoundStmt>(e)) {
-            const auto& allparents = context->getParents(*e);
-            if (allparents.size()==1) {
-                if (allparents[0].get<Stmt>()!=NULL) {
-                    const Stmt *parent = allparents[0].get<Stmt>();
-                    if (isa<IfStmt>(parent)) {
-                        const IfStmt *p = cast<IfStmt>(parent);
-                        if (p->getCond()==e) {
-                            return ParentUseCase(ParentIf, parent, p->getCond());
-                        } else {
-                            //not in the condition
-                            return ParentUseCase(ParentNonSpecial, parent);
-                        }
-                    }
-                    if (isa<ConditionalOperator>(parent)) {
-                        const ConditionalOperator *p = cast<ConditionalOperator>(parent);
-                        if (p->getCond()==e) {
-                            return ParentUseCase(ParentCE, parent, p->getCond());
-                        } else {
-                            //not in the condition
-                            return ParentUseCase(ParentNonSpecial, parent);
-                        }
-                    }
-                    if (isa<BinaryOperator>(parent)) {
-                        const BinaryOperator *p = cast<BinaryOperator>(parent);
-                        if (p->getOpcode()==BO_Assign && p->getRHS()==e) {
-                            //in an asignment
-                            return ParentUseCase(ParentAssignmentRHS, p->getRHS());
-                        }
-                    }
-                    if (isa<CallExpr>(parent)) {
-                        const CallExpr *ce = cast<CallExpr>(parent);
-                        int na = ce->getNumArgs();
-                        for(int i=0; i<na; ++i) {
-                            const Expr *arg = ce->getArg(i);
-                            if (arg==e) {
-                                return ParentUseCase(ParentNonSpecial, e);
-                            }
-                        }
-                    }
-                    if (isa<ReturnStmt>(parent)) {
-                        //TODO: if the function has no side effects, we may refactor it out (but that is outside the scope of this pass)
-                        return ParentUseCase(ParentNonSpecial, e);
-                    }
-                    e = parent;
-                } else if (allparents[0].get<VarDecl>()!=NULL) {
-                    const Expr *vd = allparents[0].get<VarDecl>()->getInit();
-                    if (vd==e) {
-                        //not an asignment proper, but we can treat it like one...
-                        return ParentUseCase(ParentAssignmentRHS, vd);
-                    } else {
-                        //parent is a VarDecl, but something funky is going on...
-                        return ParentUseCase(ParentNonSpecial, e);
-                    }
-                } else {
-                    //parent is not a Stmt
-                    return ParentUseCase(ParentNonSpecial, e);
-                }
-            } else {
-                //number of parents != 1
-                return ParentUseCase(ParentNonSpecial, e);
-            }
-        }
-        //parent is a CompoundStmt
-        return ParentUseCase(ParentNonSpecial, e);
+//true if the function is one of the FUNCTION_NAMES (in any namespace)
+static bool isConfigFunction(const FunctionDecl *f) {
+    static const char *names[] = {FUNCTION_NAMES};
+    const IdentifierInfo *id = f->getIdentifier();
+    if (id==NULL) return false;
+    for (const char *name : names) {
+        if (id->getName()==name) return true;
     }
+    return false;
+}
 
-    const Expr *getExprIgnoreParensAndImpCasts(const Expr *expr) {
-        while (isa<ParenExpr>(expr) || isa<CastExpr>(expr) || isa<ExprWithCleanups>(expr)) {
-            while (isa<ParenExpr>(expr)) {
-                expr = cast<ParenExpr>(expr)->getSubExpr();
-            }
-            while (isa<ImplicitCastExpr>(expr)) {
-                expr = cast<ImplicitCastExpr>(expr)->getSubExpr();
-            }
-            while (isa<ExprWithCleanups>(expr)) {
-                expr = cast<ExprWithCleanups>(expr)->getSubExpr();
-            }
+//true if the callee is one of the FUNCTION_NAMES. Inside a template, a call with type-dependent arguments is resolved only when it is
+//instantiated, so it is enough that all the functions found by name lookup are config functions
+static bool callsConfigFunction(const CallExpr *call) {
+    if (const FunctionDecl *callee = call->getDirectCallee()) return isConfigFunction(callee);
+    const UnresolvedLookupExpr *lookup = dyn_cast<UnresolvedLookupExpr>(call->getCallee()->IgnoreParenImpCasts());
+    if (lookup==NULL || lookup->getNumDecls()==0) return false;
+    for (const NamedDecl *d : lookup->decls()) {
+        const FunctionDecl *f = d->getAsFunction();
+        if (f==NULL || !isConfigFunction(f)) return false;
+    }
+    return true;
+}
+
+//one call to a config function, as recorded by the index subcommand
+typedef struct IndexedCall {
+    std::string term, file;
+    unsigned line;
+    ParentType kind;
+    IndexedCall(StringRef t, StringRef f, unsigned l, ParentType k) : term(t), file(f), line(l), kind(k) {}
+} IndexedCall;
+
+//A call to a config function whose term is in the TermTable (or a boolean literal written by a previous --fixed-point iteration), pending to be refactored
+typedef struct ConfigSite {
+    const Expr *expr;
+    bool value;
+    ParentUseCase useCase;
+    ConfigSite(const Expr *e, bool v, const ParentUseCase &p) : expr(e), value(v), useCase(p) {}
+} ConfigSite;
+
+//All the call sites whose rewriting affects the same expression. They have to be evaluated together, otherwise the edits for different terms would step on each other
+typedef llvm::DenseMap<const Expr*, bool> SiteValues;
+typedef struct SiteGroup {
+    ParentUseCase useCase;
+    const Expr *whole;
+    unsigned rangeSize;
+    SiteValues values;
+    SiteGroup(const ParentUseCase &p, const Expr *w, unsigned s) : useCase(p), whole(w), rangeSize(s) {}
+} SiteGroup;
+
+//Result type for MatchHandler::foldExpr: the expression is left as it is, it is a constant, it is to be replaced by one of its operands
+//(or by its negation), or it keeps its operator but some operands change
+enum FoldKind {FoldUnchanged, FoldConstant, FoldReplaced, FoldRewritten};
+typedef struct FoldResult {
+    FoldKind kind;
+    bool val;
+    //for constants: the expression is the literal itself, so its text does not change
+    bool isWritten;
+    //for FoldReplaced: the operand that takes the place of the expression (after folding it), and whether it is negated
+    const Expr *replacement;
+    bool negate;
+    FoldResult() : kind(FoldUnchanged), val(false), isWritten(false), replacement(NULL), negate(false) {}
+    FoldResult(bool v) : kind(FoldConstant), val(v), isWritten(false), replacement(NULL), negate(false) {}
+    FoldResult(const Expr *r, bool n) : kind(FoldReplaced), val(false), isWritten(false), replacement(r), negate(n) {}
+    static FoldResult written(bool v) { FoldResult r(v); r.isWritten = true; return r; }
+    static FoldResult rewritten() { FoldResult r; r.kind = FoldRewritten; return r; }
+    bool changed() const { return kind!=FoldUnchanged && !isWritten; }
+} FoldResult;
+typedef llvm::DenseMap<const Expr*, FoldResult> FoldMap;
+
+//phases timed for --stats. Parsing includes preprocessing and Sema (everything the frontend does before and after our own phases)
+enum StatsPhase {PhaseParse, PhaseMatch, PhaseClassify, PhaseRewrite, PhaseWrite, NumPhases};
+//rewrites done by MatchHandler, one per folded expression: a whole if statement, a conditional operator replaced by one of its branches, an expression rewritten
+//with some of its operands (a logical operator replaced by one of them, for example), an expression replaced by a boolean literal
+enum EditKind {EditIfBranch, EditConditionalOperator, EditPartialBoolean, EditBoolLiteral, NumEditKinds};
+//reasons to stop folding an expression before reaching the top of it (an operator that cannot be folded with a constant operand), to leave
+//it alone (it is not all written in the file), or to leave a call site alone (unknown use case)
+enum BailOutReason {BailUnaryOperator, BailBinaryOperator, BailUnknownExpr, BailMacro, BailUseCase, NumBailOutReasons};
+
+typedef std::chrono::steady_clock StatsClock;
+static double msSince(StatsClock::time_point start) {
+    return std::chrono::duration<double, std::milli>(StatsClock::now()-start).count();
+}
+
+//Counters and timings of one translation unit for --stats. Each TU has its own, filled by the thread parsing it, so they are plain
+//fields, and counting is just an increment. The writer stage adds them up for the summary of the whole run
+typedef struct TUStats {
+    std::string file;
+    bool skipped;
+    double ms[NumPhases];
+    unsigned matches;
+    unsigned edits[NumEditKinds];
+    unsigned bailOuts[NumBailOutReasons];
+    //call sites reached again after the first time (same spelled range), which are not analyzed again
+    unsigned duplicates;
+    //function bodies skipped and parsed with --skip-function-bodies
+    unsigned bodiesSkipped, bodiesParsed;
+    //declarations removed with --remove-dead-bools
+    unsigned deadDecls;
+    TUStats() : skipped(false), matches(0), duplicates(0), bodiesSkipped(0), bodiesParsed(0), deadDecls(0) {
+        std::fill(std::begin(ms), std::end(ms), 0.0);
+        std::fill(std::begin(edits), std::end(edits), 0);
+        std::fill(std::begin(bailOuts), std::end(bailOuts), 0);
+    }
+    void add(const TUStats &o) {
+        for (unsigned i = 0; i < NumPhases; ++i) ms[i] += o.ms[i];
+        for (unsigned i = 0; i < NumEditKinds; ++i) edits[i] += o.edits[i];
+        for (unsigned i = 0; i < NumBailOutReasons; ++i) bailOuts[i] += o.bailOuts[i];
+        matches += o.matches;
+        duplicates += o.duplicates;
+        bodiesSkipped += o.bodiesSkipped;
+        bodiesParsed += o.bodiesParsed;
+        deadDecls += o.deadDecls;
+    }
+} TUStats;
+
+//Ancestors of the node being visited by ConfigSiteVisitor, outermost first
+typedef llvm::ArrayRef<ast_type_traits::DynTypedNode> AncestorStack;
+
+class MatchHandler {
+public:
+    MatchHandler(RefactorEngine *r, TUStats *s) : refactorTool(r), stats(s) {}
+    //index-only: call sites are just classified with getUseCase() (index subcommand), nothing is collected or rewritten
+    explicit MatchHandler(TUStats *s) : refactorTool(NULL), stats(s) {}
+
+    bool isIndexOnly() const { return refactorTool==NULL; }
+
+    void setContext(ASTContext *c) { context = c; }
+
+    //called by ConfigSiteVisitor for each call site, while its ancestors are still at hand. The use case is classified right away,
+    //but rewriting is deferred until the whole TU has been visited, see refactorSites(). Sites are keyed by their spelled range, so a
+    //site reached more than once is analyzed and rewritten just once; returns false for these
+    bool addSite(const Expr *config, bool value, AncestorStack ancestors) {
+        if (isIndexOnly()) return false;
+        if (!spelledSites.insert(getSpelledRange(config)).second) {
+            ++stats->duplicates;
+            return false;
         }
-        return expr;
+        StatsClock::time_point start = StatsClock::now();
+        sites.push_back(ConfigSite(config, value, getUseCase(config, ancestors)));
+        stats->ms[PhaseClassify] += msSince(start);
+        return true;
     }
 
-    CondResult simplePartialEvaluation(const Expr *sub, bool value, const Expr *whole) {
-        const Stmt *s = sub, *toReturn = sub, *parent;
-        bool keepSearching = true;
-        while(s != whole && keepSearching) {
-            const auto& allparents = context->getParents(*s);
-            if (allparents.size()!=1) {
-                llvm::errs() << "expression ancestry different than expected! At one point it has " << allparents.size() << " simultaneous ancestors!!!\n Bailing out of unwinding process...";
-                showParents(s);
-                keepSearching = false;
+    //rewrite all the call sites collected by addSite(). Call sites with the same root expression (for example, several terms in the condition of an if statement) are grouped and folded together
+    void refactorSites() {
+        std::vector<SiteGroup> groups;
+        llvm::DenseMap<const Expr*, unsigned> groupIndex;
+        SourceManager &SM = context->getSourceManager();
+        for (const ConfigSite &site : sites) {
+            const ParentUseCase &p = site.useCase;
+            const Expr *whole = p.root;
+            if (whole==NULL) {
+                ++stats->bailOuts[BailUseCase];
+                continue;
+            }
+            auto it = groupIndex.find(whole);
+            unsigned idx;
+            if (it==groupIndex.end()) {
+                idx = groups.size();
+                groupIndex[whole] = idx;
+                unsigned rangeSize = SM.getFileOffset(SM.getExpansionLoc(whole->getLocEnd())) - SM.getFileOffset(SM.getExpansionLoc(whole->getLocStart()));
+                groups.push_back(SiteGroup(p, whole, rangeSize));
             } else {
-                parent = allparents[0].get<Stmt>();
-                if (isa<ParenExpr>(parent)        ||
-                    isa<ImplicitCastExpr>(parent)         ||
-                    isa<ExprWithCleanups>(parent) ) {
-                    //just go up!
-                } else if (isa<UnaryOperator>(parent)) {
-                    const UnaryOperator *o = allparents[0].get<UnaryOperator>();
-                    if (o->getOpcode()==UO_LNot) {
-                        value = !value;
-                    } else {
-                        //we do not know how to handle this, so bailing out.
-                        keepSearching = false;
-                    }
-                } else if (isa<BinaryOperator>(parent)) {
-                    const BinaryOperator *o = allparents[0].get<BinaryOperator>();
-                    auto opcode = o->getOpcode();
-                    if (opcode!=BO_LAnd && opcode!=BO_LOr) {
-                        //we do not know how to handle this, so bailing out.
-                        keepSearching = false;
-                    } else if ((opcode==BO_LAnd && !value) || (opcode==BO_LOr && value)) {
-                        //just go up!
-                    } else if ((opcode==BO_LAnd && value) || (opcode==BO_LOr && !value)) {
-                        //ok, we stop at this point and rewrite just a section of the logical expression
-                        const Stmt *lhs = o->getLHS();
-                        const Stmt *rhs = o->getRHS();
-                        const Stmt *other;
-                        if (lhs==s) {
-                            return CondResult(o, rhs);
-                        } else if (rhs==s) {
-                            return CondResult(o, lhs);
-                        } else {
-                            llvm::errs() << "There's something puzzling in the tree of this binary operator, so bailing out!\n";
-                            o->dump();
-                            keepSearching = false;
-                        }
-                    } else {
-                        //we do not know how to handle this, so bailing out.
-                        keepSearching = false;
-                    }
-                } //TODO: add support for more operators (and detect if we are actually nested in another condition (i.e. a ConditionalOperator nested in the condition of another one or the one of an IfStmt)
+                idx = it->second;
             }
-            if (keepSearching) {
-                s = parent;
+            groups[idx].values[site.expr] = site.value;
+        }
+        sites.clear();
+        spelledSites.clear();
+        //nested groups (such as a call site in an argument of a call in the condition of an if statement) have to be rewritten first, so that the rewriting of the enclosing group picks up the already rewritten text
+        std::stable_sort(groups.begin(), groups.end(), [](const SiteGroup &a, const SiteGroup &b) { return a.rangeSize < b.rangeSize; });
+        for (const SiteGroup &g : groups) {
+            if (refactorGroup(g)) {
+                for (auto &v : g.values) rewrittenSites.insert(v.first);
             }
         }
-        return CondResult(s, value);
     }
 
-    void showParents(const Stmt *s) {
-        const auto& parents = context->getParents(*s);
-        int x=0;
-        for (auto parent: parents) {
-            llvm::errs() << "  Parent " << x++ << ": \n";
-            parent.get<Stmt>()->dump();
-        }
+    //true if the site was replaced by refactorSites() (along with the rest of its group)
+    bool wasRewritten(const Expr *site) const { return rewrittenSites.count(site)>0; }
+
+    //the values of the sites added so far, for getConstantValue()
+    void getSiteValues(SiteValues &values) const {
+        for (const ConfigSite &site : sites) values[site.expr] = site.value;
     }
 
+    //fold an expression with the values of the sites, without rewriting anything. False if it is not constant
+    bool getConstantValue(const Expr *e, const SiteValues &values, bool &val) {
+        //only rewrites count as bail-outs
+        unsigned bailOuts[NumBailOutReasons];
+        std::copy(std::begin(stats->bailOuts), std::end(stats->bailOuts), bailOuts);
+        FoldMap results;
+        FoldResult res = foldExpr(e, values, results);
+        std::copy(std::begin(bailOuts), std::end(bailOuts), stats->bailOuts);
+        val = res.val;
+        return res.kind==FoldConstant;
+    }
 
-private:
-    RefactorEngine *refactorTool;
-    std::string literal;
-    ASTContext *context;
+    //fold the root expression of the group with the values of all its call sites, and write the result as a single edit: the whole if
+    //statement if its condition is constant, otherwise the smallest subexpression that holds all the changes. False if nothing was written
+    bool refactorGroup(const SiteGroup &g) {
+        const ParentUseCase &p = g.useCase;
+        FoldMap results;
+        FoldResult res = foldExpr(g.whole, g.values, results);
+        if (!res.changed()) return false;
+        if (res.kind==FoldConstant && p.ifStmt!=NULL) {
+            refactorTool->simpleRefactorIfStmt(p.ifStmt, res.val);
+            ++stats->edits[EditIfBranch];
+            return true;
+        }
+        const Expr *e = g.whole;
+        //lowest precedence the text replacing e can have without parentheses
+        Precedence slot = p.context;
+        while (results.lookup(e).kind==FoldRewritten) {
+            const Expr *changed = NULL;
+            unsigned numChanged = 0;
+            for (const Stmt *child : e->children()) {
+                if (child && isa<Expr>(child) && results.lookup(cast<Expr>(child)).changed()) {
+                    changed = cast<Expr>(child);
+                    ++numChanged;
+                }
+            }
+            if (numChanged!=1) break;
+            //implicit nodes have the same range as their operand, and do not change the context
+            if (changed->getSourceRange()!=e->getSourceRange()) {
+                slot = getOperandPrecedence(e, changed);
+            }
+            e = changed;
+        }
+        std::string text;
+        Precedence prec;
+        if (!getFoldedText(e, results, text, prec)) {
+            ++stats->bailOuts[BailMacro];
+            return false;
+        }
+        if (refactorTool->simpleReplaceExpr(e, parenthesize(text, prec, slot))) return false;
+        const FoldResult &top = results.lookup(e);
+        const ConditionalOperator *ce = dyn_cast<ConditionalOperator>(ignoreParensAndImplicit(e));
+        if (top.kind==FoldConstant) {
+            ++stats->edits[EditBoolLiteral];
+        } else if (top.kind==FoldReplaced && ce!=NULL && results.lookup(ce->getCond()).kind==FoldConstant) {
+            ++stats->edits[EditConditionalOperator];
+        } else {
+            ++stats->edits[EditPartialBoolean];
+        }
+        return true;
+    }
+
+    //evaluate an expression bottom-up with the values of the call sites, each subexpression just once. The result of each subexpression
+    //is stored in results, for getFoldedText(). Side effects in operands that are dropped are not taken into account
+    FoldResult foldExpr(const Expr *e, const SiteValues &values, FoldMap &results) {
+        FoldResult res;
+        auto site = values.find(e);
+        if (site!=values.end()) {
+            res = FoldResult(site->second);
+        } else if (isa<CXXBoolLiteralExpr>(e)) {
+            res = FoldResult::written(cast<CXXBoolLiteralExpr>(e)->getValue());
+        } else if (isa<ParenExpr>(e) || isa<ImplicitCastExpr>(e) || isa<ExprWithCleanups>(e) || isa<MaterializeTemporaryExpr>(e) || isa<CXXBindTemporaryExpr>(e)) {
+            //these just pass the result of their operand along
+            res = foldExpr(cast<Expr>(*e->child_begin()), values, results);
+        } else if (isa<ExplicitCastExpr>(e)) {
+            //a constant goes through a cast, but an operand taking the place of the cast would change the type of the expression
+            FoldResult s = foldExpr(cast<ExplicitCastExpr>(e)->getSubExpr(), values, results);
+            if (s.kind==FoldConstant) {
+                res = s;
+            } else if (s.changed()) {
+                res = FoldResult::rewritten();
+            }
+        } else if (isa<UnaryOperator>(e) && cast<UnaryOperator>(e)->getOpcode()==UO_LNot) {
+            FoldResult s = foldExpr(cast<UnaryOperator>(e)->getSubExpr(), values, results);
+            if (s.kind==FoldConstant) {
+                res = FoldResult(!s.val);
+            } else if (s.kind==FoldReplaced) {
+                res = FoldResult(s.replacement, !s.negate);
+            } else if (s.changed()) {
+                res = FoldResult::rewritten();
+            }
+        } else if (isa<BinaryOperator>(e) && cast<BinaryOperator>(e)->isLogicalOp()) {
+            const BinaryOperator *o = cast<BinaryOperator>(e);
+            //value that makes the whole operator constant: false for &&, true for ||
+            bool absorbing = o->getOpcode()==BO_LOr;
+            FoldResult l = foldExpr(o->getLHS(), values, results);
+            FoldResult r = foldExpr(o->getRHS(), values, results);
+            if ((l.kind==FoldConstant && l.val==absorbing) || (r.kind==FoldConstant && r.val==absorbing)) {
+                res = FoldResult(absorbing);
+            } else if (l.kind==FoldConstant && r.kind==FoldConstant) {
+                res = FoldResult(!absorbing);
+            } else if (l.kind==FoldConstant) {
+                res = FoldResult(o->getRHS(), false);
+            } else if (r.kind==FoldConstant) {
+                res = FoldResult(o->getLHS(), false);
+            } else if (l.changed() || r.changed()) {
+                res = FoldResult::rewritten();
+            }
+        } else if (isa<BinaryOperator>(e) && cast<BinaryOperator>(e)->isEqualityOp()) {
+            const BinaryOperator *o = cast<BinaryOperator>(e);
+            bool equal = o->getOpcode()==BO_EQ;
+            FoldResult l = foldExpr(o->getLHS(), values, results);
+            FoldResult r = foldExpr(o->getRHS(), values, results);
+            if (l.kind==FoldConstant && r.kind==FoldConstant) {
+                res = FoldResult((l.val==r.val)==equal);
+            } else if ((l.kind==FoldConstant || r.kind==FoldConstant) && (l.changed() || r.changed())) {
+                //a boolean compared to a constant is the boolean itself or its negation
+                const FoldResult &constant = l.kind==FoldConstant ? l : r;
+                const Expr *other = l.kind==FoldConstant ? o->getRHS() : o->getLHS();
+                if (other->IgnoreParenImpCasts()->getType()->isBooleanType()) {
+                    res = FoldResult(other, constant.val!=equal);
+                } else {
+                    res = FoldResult::rewritten();
+                    ++stats->bailOuts[BailBinaryOperator];
+                }
+            } else if (l.changed() || r.changed()) {
+                res = FoldResult::rewritten();
+            }
+        } else if (isa<ConditionalOperator>(e)) {
+            const ConditionalOperator *o = cast<ConditionalOperator>(e);
+            FoldResult c = foldExpr(o->getCond(), values, results);
+            FoldResult t = foldExpr(o->getTrueExpr(), values, results);
+            FoldResult f = foldExpr(o->getFalseExpr(), values, results);
+            if (c.kind==FoldConstant) {
+                const FoldResult &chosen = c.val ? t : f;
+                if (chosen.kind==FoldConstant) {
+                    res = FoldResult(chosen.val);
+                } else {
+                    res = FoldResult(c.val ? o->getTrueExpr() : o->getFalseExpr(), false);
+                }
+            } else if (t.kind==FoldConstant && f.kind==FoldConstant && t.val!=f.val && o->getCond()->IgnoreParenImpCasts()->getType()->isBooleanType()) {
+                //cond ? true : false is just cond
+                res = FoldResult(o->getCond(), f.val);
+            } else if (c.changed() || t.changed() || f.changed()) {
+                res = FoldResult::rewritten();
+            }
+        } else {
+            //we do not know how to fold this expression, but the call sites inside it are still replaced by their values
+            bool constantOperand = false;
+            for (const Stmt *child : e->children()) {
+                if (child && isa<Expr>(child)) {
+                    FoldResult c = foldExpr(cast<Expr>(child), values, results);
+                    if (c.changed()) {
+                        res = FoldResult::rewritten();
+                        constantOperand = constantOperand || c.kind==FoldConstant;
+                    }
+                }
+            }
+            if (constantOperand) {
+                ++stats->bailOuts[isa<UnaryOperator>(e) ? BailUnaryOperator : isa<BinaryOperator>(e) ? BailBinaryOperator : BailUnknownExpr];
+            }
+        }
+        results[e] = res;
+        return res;
+    }
+
+    //text of the expression after folding, without enclosing parentheses, and the precedence of its outermost operator. False if some
+    //part of it is not written in the file (for example, if it comes from a macro)
+    bool getFoldedText(const Expr *e, const FoldMap &results, std::string &text, Precedence &prec) {
+        e = ignoreParensAndImplicit(e);
+        const FoldResult &res = results.lookup(e);
+        if (!res.changed()) {
+            prec = getPrecedence(e);
+            return refactorTool->getRewrittenText(e, TextReplacements(), text);
+        }
+        if (res.kind==FoldConstant) {
+            text = res.val ? "true" : "false";
+            prec = PrecPrimary;
+            return true;
+        }
+        if (res.kind==FoldReplaced) {
+            if (!getFoldedText(res.replacement, results, text, prec)) return false;
+            if (res.negate) {
+                text = "!" + parenthesize(text, prec, PrecUnary);
+                prec = PrecUnary;
+            }
+            return true;
+        }
+        //the operator is kept, and the operands that changed are replaced, with or without parentheses depending on their precedence
+        TextReplacements replacements;
+        for (const Stmt *child : e->children()) {
+            if (!child || !isa<Expr>(child) || !results.lookup(cast<Expr>(child)).changed()) continue;
+            const Expr *c = cast<Expr>(child);
+            std::string childText;
+            Precedence childPrec;
+            if (!getFoldedText(c, results, childText, childPrec)) return false;
+            if (c->getSourceRange()==e->getSourceRange()) {
+                //implicit node, such as a converting constructor
+                text = childText;
+                prec = childPrec;
+                return true;
+            }
+            replacements.push_back(std::make_pair(c->getSourceRange(), parenthesize(childText, childPrec, getOperandPrecedence(e, c))));
+        }
+        prec = getPrecedence(e);
+        return refactorTool->getRewrittenText(e, replacements, text);
+    }
+
+    //classify the use case of a call site. The root of the use case is the largest expression containing the call that can be folded
+    //as a whole: the condition of an if statement, the right hand side of an assignment, an argument, a returned value... Conditional
+    //operators do not stop the climb, as they are folded along with their conditions
+    ParentUseCase getUseCase(const Stmt *expr, AncestorStack ancestors) {
+        const Stmt *e = expr;
+        size_t level = ancestors.size();
+        //for the index: the innermost conditional operator whose condition has the call
+        ParentType innermost = ParentUnknown;
+        //if the climb gets to a compound statement, the call is in a statement that is not handled (such as a loop)
+        ParentUseCase p(ParentNonSpecial, NULL, PrecComma);
+        while (!isa<CompoundStmt>(e)) {
+            if (level==0) {
+                //top-level statement (for example, in the initializer of a global variable)
+                p = ParentUseCase(ParentNonSpecial, dyn_cast<Expr>(e), PrecAssignment);
+                break;
+            }
+            const ast_type_traits::DynTypedNode &parentNode = ancestors[--level];
+            const Stmt *parent = parentNode.get<Stmt>();
+            if (parent==NULL) {
+                const VarDecl *vd = parentNode.get<VarDecl>();
+                //an initializer is folded like the right hand side of an assignment
+                bool isInit = vd!=NULL && vd->getInit()!=NULL && isa<Expr>(e) && vd->getInit()->IgnoreImplicit()==cast<Expr>(e)->IgnoreImplicit();
+                p = ParentUseCase(isInit ? ParentVarDecl : ParentNonSpecial, dyn_cast<Expr>(e), PrecAssignment);
+                break;
+            }
+            if (isa<IfStmt>(parent)) {
+                const IfStmt *s = cast<IfStmt>(parent);
+                if (s->getCond()==e) {
+                    p = ParentUseCase(ParentIf, cast<Expr>(e), PrecComma);
+                    p.ifStmt = s;
+                } else {
+                    //not in the condition
+                    p = ParentUseCase(ParentNonSpecial, NULL, PrecComma);
+                }
+                break;
+            }
+            if (isa<ConditionalOperator>(parent) && cast<ConditionalOperator>(parent)->getCond()==e && innermost==ParentUnknown) {
+                innermost = ParentCE;
+            }
+            if (isa<BinaryOperator>(parent)) {
+                const BinaryOperator *o = cast<BinaryOperator>(parent);
+                if (o->getOpcode()==BO_Assign && o->getRHS()==e) {
+                    //in an asignment
+                    p = ParentUseCase(ParentAssignmentRHS, o->getRHS(), PrecAssignment);
+                    break;
+                }
+            }
+            if (isa<CallExpr>(parent)) {
+                const CallExpr *ce = cast<CallExpr>(parent);
+                bool isArg = false;
+                for (const Expr *arg : ce->arguments()) {
+                    isArg = isArg || arg==e;
+                }
+                if (isArg) {
+                    //the arguments of an overloaded operator are its operands, so they might need parentheses
+                    p = ParentUseCase(ParentNonSpecial, cast<Expr>(e), isa<CXXOperatorCallExpr>(ce) ? PrecPrimary : PrecAssignment);
+                    break;
+                }
+            }
+            if (isa<ReturnStmt>(parent)) {
+                //the calls to the function are replaced by this value with --remove-dead-bools, see DeadBoolVisitor
+                p = ParentUseCase(ParentNonSpecial, dyn_cast<Expr>(e), PrecComma);
+                break;
+            }
+            e = parent;
+        }
+        if (innermost!=ParentUnknown) p.type = innermost;
+        return p;
+    }
+
+
+private:
+    //where the expression is written: for a site in a macro expansion, the range of the expansion
+    std::tuple<FileID, unsigned, unsigned> getSpelledRange(const Expr *expr) const {
+        SourceManager &SM = context->getSourceManager();
+        std::pair<FileID, unsigned> b = SM.getDecomposedLoc(SM.getExpansionLoc(expr->getLocStart()));
+        std::pair<FileID, unsigned> e = SM.getDecomposedLoc(SM.getExpansionLoc(expr->getLocEnd()));
+        return std::make_tuple(b.first, b.second, e.first==b.first && e.second>=b.second ? e.second-b.second : 0);
+    }
+
+    RefactorEngine *refactorTool;
+    TUStats *stats;
+    std::vector<ConfigSite> sites;
+    //(file, offset, length) of the sites added so far
+    std::set<std::tuple<FileID, unsigned, unsigned>> spelledSites;
+    llvm::DenseSet<const Expr*> rewrittenSites;
+    ASTContext *context;
+};
+
+//all the terms to refactor out in this run, filled in main() from the command line
+static TermTable Terms;
+
+//offsets of the boolean literals written by the previous --fixed-point iteration, by canonical path. They are refactored out in the next
+//iteration as if they were calls to config functions. Filled in runFixedPoint() between iterations, read-only while the workers run
+static llvm::StringMap<std::set<unsigned>> FoldedLiterals;
+
+//Single pass over the AST to find the calls to config functions whose first argument is one of the terms. The ancestors of the node
+//being visited are kept in an explicit stack, so each call site is classified without ASTContext::getParents(), which would build
+//the parent map of the whole TU (including every #included header) the first time it is used
+class ConfigSiteVisitor : public RecursiveASTVisitor<ConfigSiteVisitor> {
+public:
+    ConfigSiteVisitor(MatchHandler *h, const TermTable *t) : numSites(0), handler(h), terms(t), SourceMgr(NULL), indexSink(NULL) {}
+
+    void setSourceMgr(SourceManager &SM) { SourceMgr = &SM; }
+
+    //index mode: all the calls to config functions with a literal are recorded in calls, with their use case, instead of being refactored
+    void setIndexSink(std::vector<IndexedCall> *calls) { indexSink = calls; }
+
+    //only code as written: the body of a template is visited once, not once per instantiation (every instantiation would reach the same
+    //spelled call sites, each one with its own AST)
+    bool shouldVisitTemplateInstantiations() const { return false; }
+
+    //these override the versions without a DataRecursionQueue, so the children are traversed recursively through them, and the stack is always accurate
+    bool TraverseStmt(Stmt *S) {
+        if (S==NULL) return true;
+        ancestors.push_back(ast_type_traits::DynTypedNode::create(*S));
+        bool ok = RecursiveASTVisitor<ConfigSiteVisitor>::TraverseStmt(S);
+        ancestors.pop_back();
+        return ok;
+    }
+
+    bool TraverseDecl(Decl *D) {
+        if (D==NULL) return true;
+        ancestors.push_back(ast_type_traits::DynTypedNode::create(*D));
+        bool ok = RecursiveASTVisitor<ConfigSiteVisitor>::TraverseDecl(D);
+        ancestors.pop_back();
+        return ok;
+    }
+
+    bool VisitCallExpr(CallExpr *call) {
+        const StringLiteral *lit = getTermLiteral(call);
+        bool value;
+        if (lit==NULL || (indexSink==NULL && !terms->lookup(lit->getString(), value))) return true;
+        if (!callsConfigFunction(call)) return true;
+        //the top of the stack is the call itself
+        if (indexSink!=NULL) {
+            SourceLocation loc = SourceMgr->getExpansionLoc(call->getLocStart());
+            if (const FileEntry *entry = SourceMgr->getFileEntryForID(SourceMgr->getFileID(loc))) {
+                ParentUseCase p = handler->getUseCase(call, AncestorStack(ancestors).drop_back());
+                indexSink->push_back(IndexedCall(lit->getString(), getCanonicalPath(entry->getName()), SourceMgr->getExpansionLineNumber(loc), p.type));
+            }
+            return true;
+        }
+        if (handler->addSite(call, value, AncestorStack(ancestors).drop_back())) ++numSites;
+        return true;
+    }
+
+    bool VisitCXXBoolLiteralExpr(CXXBoolLiteralExpr *lit) {
+        if (FoldedLiterals.empty() || !lit->getLocation().isFileID()) return true;
+        std::pair<FileID, unsigned> loc = SourceMgr->getDecomposedLoc(lit->getLocation());
+        auto it = foldedLiteralsByFile.find(loc.first);
+        if (it==foldedLiteralsByFile.end()) {
+            const std::set<unsigned> *offsets = NULL;
+            if (const FileEntry *entry = SourceMgr->getFileEntryForID(loc.first)) {
+                auto found = FoldedLiterals.find(getCanonicalPath(entry->getName()));
+                if (found!=FoldedLiterals.end()) {
+                    offsets = &found->second;
+                }
+            }
+            it = foldedLiteralsByFile.insert(std::make_pair(loc.first, offsets)).first;
+        }
+        if (it->second!=NULL && it->second->count(loc.second)>0) {
+            if (handler->addSite(lit, lit->getValue(), AncestorStack(ancestors).drop_back())) ++numSites;
+        }
+        return true;
+    }
+
+    unsigned numSites;
+
+private:
+    MatchHandler *handler;
+    const TermTable *terms;
+    SourceManager *SourceMgr;
+    std::vector<IndexedCall> *indexSink;
+    std::vector<ast_type_traits::DynTypedNode> ancestors;
+    //FoldedLiterals of each file in the TU, to avoid looking up the path for each literal
+    llvm::DenseMap<FileID, const std::set<unsigned>*> foldedLiteralsByFile;
+};
+
+//true if evaluating the expression may have side effects, apart from the sites (which are replaced by constants). Conservative: anything
+//but references, literals, casts, parentheses and operators without side effects counts, calls included
+static bool mayHaveSideEffects(const Expr *e, const SiteValues &values) {
+    if (values.count(e)>0) return false;
+    if (e->getType().isVolatileQualified()) return true;
+    if (isa<UnaryOperator>(e)) {
+        if (cast<UnaryOperator>(e)->isIncrementDecrementOp()) return true;
+    } else if (isa<BinaryOperator>(e)) {
+        if (cast<BinaryOperator>(e)->isAssignmentOp()) return true;
+    } else if (!isa<DeclRefExpr>(e) && !isa<MemberExpr>(e) && !isa<CXXThisExpr>(e) && !isa<ArraySubscriptExpr>(e) && !isa<ParenExpr>(e) &&
+               !isa<CastExpr>(e) && !isa<ConditionalOperator>(e) && !isa<ExprWithCleanups>(e) && !isa<MaterializeTemporaryExpr>(e) &&
+               !isa<CXXBindTemporaryExpr>(e) && !isa<CXXBoolLiteralExpr>(e) && !isa<IntegerLiteral>(e) && !isa<CharacterLiteral>(e) &&
+               !isa<FloatingLiteral>(e) && !isa<StringLiteral>(e) && !isa<CXXNullPtrLiteralExpr>(e)) {
+        return true;
+    }
+    for (const Stmt *child : e->children()) {
+        if (child && isa<Expr>(child) && mayHaveSideEffects(cast<Expr>(child), values)) return true;
+    }
+    return false;
+}
+
+//a use of a DeadBoolCandidate that is replaced by its value, with the ancestors it had when it was visited, for MatchHandler::addSite()
+typedef struct DeadBoolRead {
+    const Expr *expr;
+    std::vector<ast_type_traits::DynTypedNode> ancestors;
+    DeadBoolRead(const Expr *e, AncestorStack a) : expr(e), ancestors(a.begin(), a.end()) {}
+} DeadBoolRead;
+
+//a declaration that --remove-dead-bools may refactor out: a local boolean variable, a private boolean field or a boolean function whose
+//body is a single return statement
+typedef struct DeadBoolCandidate {
+    const NamedDecl *decl;
+    //the declaration qualifies (it has been visited), and no use of it prevents refactoring it out
+    bool declared, disqualified;
+    //the initializer and the right hand sides of the assignments, or the returned expression
+    std::vector<const Expr*> values;
+    //assignments written as statements of their own, removed along with the declaration
+    std::vector<const Expr*> assignments;
+    //reads of the variable, calls to the function
+    std::vector<DeadBoolRead> reads;
+    //what is removed if all the reads are replaced: the DeclStmt, the FieldDecl or the FunctionDecl (invalid if it cannot be removed),
+    //and whether the semicolon after it has to go as well
+    SourceRange removal;
+    bool withSemicolon;
+    //all the values fold to the same constant
+    bool eligible, value;
+    DeadBoolCandidate(const NamedDecl *d) : decl(d), declared(false), disqualified(false), withSemicolon(false), eligible(false), value(false) {}
+} DeadBoolCandidate;
+
+//--remove-dead-bools: single pass over the AST (with the same explicit stack of ancestors as ConfigSiteVisitor) to find the candidates and
+//all their uses. A candidate is disqualified by any use that is not a read, an assignment statement with no other side effects, or a call
+//with arguments without side effects, so all of them are known. Private fields also require every piece of code with access to them to
+//be in this translation unit, and an in-class initializer (which is their value until they are assigned)
+class DeadBoolVisitor : public RecursiveASTVisitor<DeadBoolVisitor> {
+public:
+    DeadBoolVisitor() : SourceMgr(NULL) {}
+
+    void setSourceMgr(SourceManager &SM) { SourceMgr = &SM; }
+
+    bool shouldVisitTemplateInstantiations() const { return false; }
+
+    bool TraverseStmt(Stmt *S) {
+        if (S==NULL) return true;
+        ancestors.push_back(ast_type_traits::DynTypedNode::create(*S));
+        bool ok = RecursiveASTVisitor<DeadBoolVisitor>::TraverseStmt(S);
+        ancestors.pop_back();
+        return ok;
+    }
+
+    bool TraverseDecl(Decl *D) {
+        if (D==NULL) return true;
+        ancestors.push_back(ast_type_traits::DynTypedNode::create(*D));
+        bool ok = RecursiveASTVisitor<DeadBoolVisitor>::TraverseDecl(D);
+        ancestors.pop_back();
+        return ok;
+    }
+
+    bool VisitVarDecl(VarDecl *vd) {
+        if (isa<ParmVarDecl>(vd) || !vd->hasLocalStorage() || vd->isExceptionVariable() || vd->isCXXForRangeDecl() || !isBool(vd->getType()) ||
+            vd->getDeclContext()->isDependentContext()) return true;
+        //the top of the stack is the declaration, which has to be alone in a statement of its own
+        size_t n = ancestors.size();
+        const DeclStmt *ds = n>=3 ? ancestors[n-2].get<DeclStmt>() : NULL;
+        if (ds==NULL || !ds->isSingleDecl() || ancestors[n-3].get<CompoundStmt>()==NULL) return true;
+        DeadBoolCandidate &c = getCandidate(vd);
+        c.declared = true;
+        c.removal = ds->getSourceRange();
+        if (vd->getInit()!=NULL) c.values.push_back(vd->getInit());
+        return true;
+    }
+
+    bool VisitFieldDecl(FieldDecl *fd) {
+        if (fd->getAccess()!=AS_private || !isBool(fd->getType()) || !fd->hasInClassInitializer() || !fd->getLocation().isFileID() ||
+            !SourceMgr->isInMainFile(fd->getLocation())) return true;
+        const CXXRecordDecl *rd = dyn_cast<CXXRecordDecl>(fd->getParent());
+        if (rd==NULL || !isClosed(rd)) return true;
+        //bool a = ..., b = ...;
+        for (const FieldDecl *other : rd->fields()) {
+            if (other!=fd && other->getLocStart()==fd->getLocStart()) return true;
+        }
+        DeadBoolCandidate &c = getCandidate(fd);
+        c.declared = true;
+        c.removal = fd->getSourceRange();
+        c.withSemicolon = true;
+        c.values.push_back(fd->getInClassInitializer());
+        return true;
+    }
+
+    bool VisitFunctionDecl(FunctionDecl *fd) {
+        if (!isBool(fd->getReturnType()) || !fd->doesThisDeclarationHaveABody() || fd->isMain() || fd->isDependentContext() ||
+            fd->getTemplatedKind()!=FunctionDecl::TK_NonTemplate || fd->isOverloadedOperator() || isa<CXXConversionDecl>(fd)) return true;
+        const CXXMethodDecl *md = dyn_cast<CXXMethodDecl>(fd);
+        if (md!=NULL && md->isVirtual()) return true;
+        const CompoundStmt *body = dyn_cast_or_null<CompoundStmt>(fd->getBody());
+        if (body==NULL || body->size()!=1 || !isa<ReturnStmt>(body->body_front())) return true;
+        const Expr *returned = cast<ReturnStmt>(body->body_front())->getRetValue();
+        if (returned==NULL) return true;
+        DeadBoolCandidate &c = getCandidate(fd);
+        c.declared = true;
+        c.values.push_back(returned);
+        //other translation units may call it, or see another declaration
+        if (md==NULL && !fd->isExternallyVisible() && fd->getPreviousDecl()==NULL && fd->getMostRecentDecl()==fd && SourceMgr->isInMainFile(fd->getLocation())) {
+            c.removal = fd->getSourceRange();
+        }
+        return true;
+    }
+
+    bool VisitDeclRefExpr(DeclRefExpr *ref) { return handleUse(ref, ref->getDecl()); }
+
+    bool VisitMemberExpr(MemberExpr *member) { return handleUse(member, member->getMemberDecl()); }
+
+    //the field would still be initialized there
+    bool VisitCXXConstructorDecl(CXXConstructorDecl *ctor) {
+        for (const CXXCtorInitializer *init : ctor->inits()) {
+            if (init->isWritten() && init->getMember()!=NULL) disqualify(init->getMember());
+        }
+        return true;
+    }
+
+    //the variable would still be named in the capture list
+    bool VisitLambdaExpr(LambdaExpr *lambda) {
+        for (const LambdaCapture &capture : lambda->explicit_captures()) {
+            if (capture.capturesVariable()) disqualify(capture.getCapturedVar());
+        }
+        return true;
+    }
+
+    //names that templates use without knowing yet what they refer to
+    bool VisitOverloadExpr(OverloadExpr *e) { dependentNames.insert(e->getName()); return true; }
+    bool VisitDependentScopeDeclRefExpr(DependentScopeDeclRefExpr *e) { dependentNames.insert(e->getDeclName()); return true; }
+    bool VisitCXXDependentScopeMemberExpr(CXXDependentScopeMemberExpr *e) { dependentNames.insert(e->getMember()); return true; }
+
+    //once the whole TU has been visited (and all the call sites have been added to the handler): the reads of the candidates whose values
+    //are all the same constant are added as sites. Their values may in turn make other candidates constant, so this goes on until no more
+    //candidates are found
+    void addConstantReads(MatchHandler &handler) {
+        //locals are never looked up this way: they are not candidates in templates
+        for (DeadBoolCandidate &c : candidates) {
+            if (!isa<VarDecl>(c.decl) && dependentNames.count(c.decl->getDeclName())>0) c.disqualified = true;
+        }
+        SiteValues values;
+        bool added = true;
+        while (added) {
+            added = false;
+            values.clear();
+            handler.getSiteValues(values);
+            for (DeadBoolCandidate &c : candidates) {
+                if (!c.declared || c.disqualified || c.eligible || c.values.empty() || !getValue(c, handler, values)) continue;
+                c.eligible = true;
+                added = true;
+                for (const DeadBoolRead &r : c.reads) {
+                    handler.addSite(r.expr, c.value, r.ancestors);
+                }
+            }
+        }
+    }
+
+    //after MatchHandler::refactorSites(): the declarations (and assignments) of the candidates whose reads have all been replaced are
+    //removed. Returns how many declarations were removed
+    unsigned removeDeclarations(const MatchHandler &handler, RefactorEngine &refactorTool) {
+        unsigned removed = 0;
+        for (const DeadBoolCandidate &c : candidates) {
+            if (!c.eligible || c.removal.isInvalid()) continue;
+            bool replaced = true;
+            for (const DeadBoolRead &r : c.reads) {
+                replaced = replaced && handler.wasRewritten(r.expr);
+            }
+            if (!replaced) continue;
+            for (const Expr *a : c.assignments) {
+                refactorTool.removeStmtOrDecl(a->getSourceRange(), true);
+            }
+            if (!refactorTool.removeStmtOrDecl(c.removal, c.withSemicolon)) ++removed;
+        }
+        return removed;
+    }
+
+private:
+    static bool isBool(QualType type) { return type->isBooleanType() && !type.isVolatileQualified(); }
+
+    //all the code with access to the private members of the class is in this translation unit: no friends, no nested classes, no member
+    //templates, and every method is defined
+    static bool isClosed(const CXXRecordDecl *rd) {
+        if (rd->isDependentContext() || rd->isLambda() || rd->isUnion() || rd->friend_begin()!=rd->friend_end()) return false;
+        for (const Decl *d : rd->decls()) {
+            if (isa<CXXRecordDecl>(d) && !cast<CXXRecordDecl>(d)->isInjectedClassName()) return false;
+            if (isa<ClassTemplateDecl>(d) || isa<FunctionTemplateDecl>(d)) return false;
+        }
+        for (const CXXMethodDecl *m : rd->methods()) {
+            if (!m->isImplicit() && !m->isDefined() && !m->isPure()) return false;
+        }
+        return true;
+    }
+
+    DeadBoolCandidate &getCandidate(const NamedDecl *d) {
+        d = cast<NamedDecl>(d->getCanonicalDecl());
+        auto it = index.find(d);
+        if (it!=index.end()) return candidates[it->second];
+        index[d] = candidates.size();
+        candidates.push_back(DeadBoolCandidate(d));
+        return candidates.back();
+    }
+
+    void disqualify(const NamedDecl *d) { getCandidate(d).disqualified = true; }
+
+    //true if all the values of the candidate fold to the same constant, and evaluating them has no side effects
+    bool getValue(DeadBoolCandidate &c, MatchHandler &handler, const SiteValues &values) {
+        for (size_t i = 0; i < c.values.size(); ++i) {
+            bool val;
+            if (mayHaveSideEffects(c.values[i], values) || !handler.getConstantValue(c.values[i], values, val)) return false;
+            if (i>0 && val!=c.value) return false;
+            c.value = val;
+        }
+        return true;
+    }
+
+    //the node at this position of the stack, if it is a statement
+    const Stmt *getStmt(size_t level) const { return level<ancestors.size() ? ancestors[level].get<Stmt>() : NULL; }
+
+    //classify a reference to a variable, a field or a function. The top of the stack is the reference itself
+    bool handleUse(const Expr *ref, const ValueDecl *d) {
+        const NamedDecl *canonical = cast<NamedDecl>(d->getCanonicalDecl());
+        if (index.count(canonical)==0) {
+            //locals are always declared before they are used, but fields and functions may be used before their declarations are visited
+            const FieldDecl *fd = dyn_cast<FieldDecl>(d);
+            const FunctionDecl *fn = dyn_cast<FunctionDecl>(d);
+            if (fd!=NULL ? fd->getAccess()!=AS_private || !isBool(fd->getType()) :
+                fn==NULL || !isBool(fn->getReturnType()) || SourceMgr->isInSystemHeader(fn->getLocation())) return true;
+        }
+        DeadBoolCandidate &c = getCandidate(canonical);
+        if (c.disqualified) return true;
+        //uses written in macros could not be rewritten
+        if (!ref->getLocStart().isFileID() || !ref->getLocEnd().isFileID()) return disqualify(c);
+        size_t level = ancestors.size()-1;
+        if (isa<FunctionDecl>(d)) {
+            //f(args), obj.f(args)
+            const Expr *callee = ref;
+            if (isa<DeclRefExpr>(ref)) {
+                const ImplicitCastExpr *decay = dyn_cast_or_null<ImplicitCastExpr>(getStmt(--level));
+                if (decay==NULL || decay->getCastKind()!=CK_FunctionToPointerDecay) return disqualify(c);
+                callee = decay;
+            }
+            const CallExpr *call = dyn_cast_or_null<CallExpr>(getStmt(--level));
+            if (call==NULL || call->getCallee()!=callee) return disqualify(c);
+            SiteValues none;
+            for (const Expr *arg : call->arguments()) {
+                if (mayHaveSideEffects(arg, none)) return disqualify(c);
+            }
+            if (isa<CXXMemberCallExpr>(call) && mayHaveSideEffects(cast<CXXMemberCallExpr>(call)->getImplicitObjectArgument(), none)) return disqualify(c);
+            c.reads.push_back(DeadBoolRead(call, AncestorStack(ancestors).take_front(level)));
+            return true;
+        }
+        if (isa<MemberExpr>(ref) && mayHaveSideEffects(cast<MemberExpr>(ref)->getBase(), SiteValues())) return disqualify(c);
+        const Expr *e = ref;
+        const Stmt *parent;
+        while ((parent = getStmt(--level))!=NULL && isa<ParenExpr>(parent)) e = cast<Expr>(parent);
+        if (parent!=NULL && isa<ImplicitCastExpr>(parent) && cast<ImplicitCastExpr>(parent)->getCastKind()==CK_LValueToRValue) {
+            c.reads.push_back(DeadBoolRead(ref, AncestorStack(ancestors).drop_back()));
+            return true;
+        }
+        const BinaryOperator *assign = dyn_cast_or_null<BinaryOperator>(parent);
+        if (assign!=NULL && assign->getOpcode()==BO_Assign && assign->getLHS()==e) {
+            //a statement of its own, maybe with the temporaries of the right hand side
+            const Stmt *stmt;
+            while ((stmt = getStmt(--level))!=NULL && isa<ExprWithCleanups>(stmt)) {}
+            if (stmt==NULL || !isa<CompoundStmt>(stmt)) return disqualify(c);
+            c.values.push_back(assign->getRHS());
+            c.assignments.push_back(assign);
+            return true;
+        }
+        return disqualify(c);
+    }
+
+    bool disqualify(DeadBoolCandidate &c) {
+        c.disqualified = true;
+        return true;
+    }
+
+    SourceManager *SourceMgr;
+    std::vector<ast_type_traits::DynTypedNode> ancestors;
+    //in the order they are found, so the sites are always added in the same order
+    std::vector<DeadBoolCandidate> candidates;
+    llvm::DenseMap<const Decl*, unsigned> index;
+    llvm::DenseSet<DeclarationName> dependentNames;
+};
+
+//--skip-function-bodies: decides which function bodies the parser can skip. A body can be skipped if there is no call site in it, that is,
+//if none of the terms appears as a string literal between the end of the declarator and the closing brace (so constructor initializers and
+//function try blocks are covered), nor any of the literals written by the previous --fixed-point iteration. The offsets of the literals are
+//found once per file, and the end of the body is found with the raw lexer, which stops as soon as it gets to the next literal. It is
+//conservative: bodies with preprocessor directives, with macros whose expansion has a term, or whose declarator ends in a macro are parsed
+class FunctionBodySkipper {
+    SourceManager *SM;
+    const LangOptions *LangOpts;
+    Preprocessor *PP;
+    const TermTable *terms;
+    //offsets of the literals in each file, sorted
+    llvm::DenseMap<FileID, std::vector<unsigned>> literals;
+    llvm::DenseMap<const MacroInfo*, bool> macrosWithTerms;
+
+    //same scan as TermPrefilter::findTerms(), recording the offsets of the opening quotes
+    const std::vector<unsigned> &getLiterals(FileID FID) {
+        auto it = literals.find(FID);
+        if (it!=literals.end()) return it->second;
+        std::vector<unsigned> offsets;
+        StringRef text = SM->getBufferData(FID);
+        const char *p = text.begin(), *end = text.end();
+        size_t minLen = terms->minLength(), maxLen = terms->maxLength();
+        while (p<end && (p = (const char*)memchr(p, '"', end-p)) != NULL) {
+            ++p;
+            const char *q = (const char*)memchr(p, '"', std::min<size_t>(end-p, maxLen+1));
+            if (q!=NULL && (size_t)(q-p)>=minLen && terms->contains(StringRef(p, q-p))) {
+                offsets.push_back(p-1-text.begin());
+            }
+        }
+        if (!FoldedLiterals.empty()) {
+            if (const FileEntry *entry = SM->getFileEntryForID(FID)) {
+                auto found = FoldedLiterals.find(getCanonicalPath(entry->getName()));
+                if (found!=FoldedLiterals.end()) {
+                    offsets.insert(offsets.end(), found->second.begin(), found->second.end());
+                    std::sort(offsets.begin(), offsets.end());
+                }
+            }
+        }
+        return literals[FID] = std::move(offsets);
+    }
+
+    //true if the expansion of the macro has a term as a string literal, directly or through other macros
+    bool macroHasTerms(const MacroInfo *MI) {
+        auto it = macrosWithTerms.find(MI);
+        if (it!=macrosWithTerms.end()) return it->second;
+        //recursive macros
+        macrosWithTerms[MI] = false;
+        bool found = false;
+        for (const Token &Tok : MI->tokens()) {
+            if (Tok.is(tok::string_literal)) {
+                StringRef lit(Tok.getLiteralData(), Tok.getLength());
+                found = lit.size()>=2 && terms->contains(lit.substr(1, lit.size()-2));
+            } else if (Tok.is(tok::identifier) && Tok.getIdentifierInfo()->hasMacroDefinition()) {
+                const MacroInfo *used = PP->getMacroInfo(Tok.getIdentifierInfo());
+                found = used!=NULL && macroHasTerms(used);
+            }
+            if (found) break;
+        }
+        return macrosWithTerms[MI] = found;
+    }
+
+public:
+    FunctionBodySkipper(SourceManager &sm, const LangOptions &lo, Preprocessor &pp, const TermTable *t) : SM(&sm), LangOpts(&lo), PP(&pp), terms(t) {}
+
+    bool canSkip(const Decl *D) {
+        const FunctionDecl *FD = D->getAsFunction();
+        //Sema does not skip these anyway
+        if (FD==NULL || FD->isConstexpr() || FD->getReturnType()->isUndeducedType()) return false;
+        //the body is not there yet, so this is the end of the declarator
+        SourceLocation declEnd = FD->getLocEnd();
+        if (declEnd.isInvalid() || !declEnd.isFileID()) return false;
+        if (SM->isInSystemHeader(declEnd)) return true;
+        std::pair<FileID, unsigned> loc = SM->getDecomposedLoc(declEnd);
+        const std::vector<unsigned> &offsets = getLiterals(loc.first);
+        auto next = std::upper_bound(offsets.begin(), offsets.end(), loc.second);
+        unsigned limit = next==offsets.end() ? std::numeric_limits<unsigned>::max() : *next;
+        StringRef buffer = SM->getBufferData(loc.first);
+        Lexer lexer(SM->getLocForStartOfFile(loc.first), *LangOpts, buffer.begin(), buffer.begin()+loc.second, buffer.end());
+        Token Tok;
+        //the last token of the declarator
+        lexer.LexFromRawLexer(Tok);
+        int depth = 0;
+        bool closed = false;
+        while (true) {
+            lexer.LexFromRawLexer(Tok);
+            if (closed) {
+                //a closing brace followed by these is the end of a brace initializer or of a try block, not of the body
+                if (!Tok.is(tok::comma) && !Tok.is(tok::l_brace) && !(Tok.is(tok::raw_identifier) && Tok.getRawIdentifier()=="catch")) return true;
+                closed = false;
+            }
+            if (Tok.is(tok::eof) || SM->getFileOffset(Tok.getLocation())>=limit) return false;
+            if (Tok.is(tok::hash) && Tok.isAtStartOfLine()) return false;
+            if (Tok.is(tok::raw_identifier)) {
+                IdentifierInfo *II = PP->getIdentifierInfo(Tok.getRawIdentifier());
+                if (II->hasMacroDefinition()) {
+                    const MacroInfo *MI = PP->getMacroInfo(II);
+                    if (MI!=NULL && macroHasTerms(MI)) return false;
+                }
+            }
+            switch (Tok.getKind()) {
+                case tok::l_paren: case tok::l_square: case tok::l_brace:
+                    ++depth;
+                    break;
+                case tok::r_paren: case tok::r_square:
+                    if (--depth<0) return false;
+                    break;
+                case tok::r_brace:
+                    if (--depth<0) return false;
+                    closed = depth==0;
+                    break;
+                case tok::semi:
+                    if (depth==0) return false;
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
 };
 
 // Implementation of the ASTConsumer interface for reading an AST produced
 // by the Clang parser.
 class MyASTConsumer : public ASTConsumer {
 public:
-    MyASTConsumer(RefactorEngine *R) : handler(R, TermName.getValue()) {
-        // Add a simple matcher for finding calls to config functions.
-        Matcher.addMatcher(
-            callExpr(
-                     callee(functionDecl(hasAnyName(FUNCTION_NAMES))),
-                     hasArgument(0, allOf(
-                                          hasDescendant(stringLiteral().bind("strLiteral")),
-                                          unless(anyOf(
-                                                       hasDescendant(callExpr()),
-                                                       hasDescendant(binaryOperator()),
-                                                       hasDescendant(unaryOperator())
-                                                 ))
-                                 ))
-                     ).bind("callToConfigFunction"),
-            &handler
-        );
+    MyASTConsumer(RefactorEngine *R, const TermTable *t, TUStats *s) : refactorTool(R), handler(R, s), Visitor(&handler, t), stats(s), lastAsked(NULL), lastSkipped(false) {}
 
+  //only asked if the frontend has been told to skip function bodies, see MyFrontendAction::CreateASTConsumer()
+  void setBodySkipper(std::unique_ptr<FunctionBodySkipper> s) { skipper = std::move(s); }
+
+  bool shouldSkipFunctionBody(Decl *D) override {
+    if (skipper==nullptr) return false;
+    //Sema may ask more than once for the same body
+    if (D!=lastAsked) {
+      lastAsked = D;
+      lastSkipped = skipper->canSkip(D);
+      ++(lastSkipped ? stats->bodiesSkipped : stats->bodiesParsed);
     }
+    return lastSkipped;
+  }
 
   void HandleTranslationUnit(ASTContext &Context) override {
     handler.setContext(&Context);
-    // Run the matcher when we have the whole TU parsed.
-    Matcher.matchAST(Context);
-    //TODO: here we might do further processing if required, such as creating and using new matchers/handlers or visitors for:
-    //   * refactoring out boolean variables which are given values based on config functions whose assignments have no side effects
-    //   * refactoring out simple boolean functions
+    // Run the visitor when we have the whole TU parsed. Declarations in system headers cannot call config functions, so they are not even traversed
+    StatsClock::time_point start = StatsClock::now();
+    //classification happens while visiting, it is timed apart
+    double classifyBefore = stats->ms[PhaseClassify];
+    SourceManager &SM = Context.getSourceManager();
+    Visitor.setSourceMgr(SM);
+    deadBools.setSourceMgr(SM);
+    unsigned numDecls = 0, numSkipped = 0;
+    for (Decl *D : Context.getTranslationUnitDecl()->decls()) {
+      ++numDecls;
+      if (SM.isInSystemHeader(D->getLocation())) {
+        ++numSkipped;
+      } else {
+        Visitor.TraverseDecl(D);
+        if (RemoveDeadBools.getValue()) deadBools.TraverseDecl(D);
+      }
+    }
+    if (RemoveDeadBools.getValue()) deadBools.addConstantReads(handler);
+    double ms = msSince(start);
+    stats->ms[PhaseMatch] += ms-(stats->ms[PhaseClassify]-classifyBefore);
+    stats->matches += Visitor.numSites;
+    if (TimeMatching.getValue()) {
+      llvm::errs() << "Matching " << SM.getFileEntryForID(SM.getMainFileID())->getName() << ": " << ms << " ms, "
+                   << numDecls-numSkipped << " top-level declarations visited, " << numSkipped << " skipped in system headers, " << Visitor.numSites << " call sites\n";
+    }
+    start = StatsClock::now();
+    handler.refactorSites();
+    if (RemoveDeadBools.getValue()) {
+      stats->deadDecls += deadBools.removeDeclarations(handler, *refactorTool);
+    }
+    refactorTool->rewriteIfStmts();
+    stats->ms[PhaseRewrite] += msSince(start);
   }
 
 private:
+  RefactorEngine *refactorTool;
   MatchHandler handler;
-  MatchFinder Matcher;
+  ConfigSiteVisitor Visitor;
+  DeadBoolVisitor deadBools;
+  TUStats *stats;
+  std::unique_ptr<FunctionBodySkipper> skipper;
+  const Decl *lastAsked;
+  bool lastSkipped;
+};
+
+//include paths of a compile command, absolute: -iquote, -I/-isystem/-idirafter, and -include
+struct IncludePaths {
+    std::vector<std::string> quoted, angled, forced;
+};
+
+static std::string absoluteIn(StringRef dir, StringRef path) {
+    SmallString<256> result(path);
+    if (!llvm::sys::path::is_absolute(result)) {
+        result = getAbsolutePath(dir);
+        llvm::sys::path::append(result, path);
+    }
+    llvm::sys::path::remove_dots(result, true);
+    return result.str();
+}
+
+static IncludePaths getIncludePaths(const CompileCommand &command) {
+    IncludePaths paths;
+    const std::vector<std::string> &args = command.CommandLine;
+    for (size_t i = 0; i < args.size(); ++i) {
+        StringRef arg = args[i];
+        std::vector<std::string> *list = NULL;
+        StringRef flag;
+        if (arg.startswith("-iquote"))          { list = &paths.quoted; flag = "-iquote"; }
+        else if (arg.startswith("-isystem"))    { list = &paths.angled; flag = "-isystem"; }
+        else if (arg.startswith("-idirafter"))  { list = &paths.angled; flag = "-idirafter"; }
+        else if (arg.startswith("-include"))    { list = &paths.forced; flag = "-include"; }
+        else if (arg.startswith("-I"))          { list = &paths.angled; flag = "-I"; }
+        else continue;
+        StringRef value = arg.drop_front(flag.size());
+        if (value.startswith("=")) value = value.drop_front(1);
+        if (value.empty()) {
+            if (i+1==args.size()) break;
+            value = args[++i];
+        }
+        list->push_back(absoluteIn(command.Directory, value));
+    }
+    return paths;
+}
+
+//the file an #include resolves to, as clang would look it up with these include paths (except for the system include paths)
+static bool resolveInclude(const std::string &name, bool angled, StringRef includerDir, const IncludePaths &paths, std::string &resolved) {
+    if (llvm::sys::path::is_absolute(name)) {
+        resolved = name;
+        return llvm::sys::fs::exists(resolved);
+    }
+    if (!angled) {
+        resolved = absoluteIn(includerDir, name);
+        if (llvm::sys::fs::exists(resolved)) return true;
+        for (const std::string &dir : paths.quoted) {
+            resolved = absoluteIn(dir, name);
+            if (llvm::sys::fs::exists(resolved)) return true;
+        }
+    }
+    for (const std::string &dir : paths.angled) {
+        resolved = absoluteIn(dir, name);
+        if (llvm::sys::fs::exists(resolved)) return true;
+    }
+    return false;
+}
+
+//Byte-level prefilter, run before a translation unit is handed to the frontend: it looks for the terms as quoted string literals in the
+//main file and in the files it #includes (resolved with the include paths of the compile command). Translation units where none of the
+//terms appear cannot have anything to refactor, so they skip parsing altogether. It is conservative: unreadable files and computed
+//#includes count as hits, and #includes inside #if blocks are followed anyway. Unresolved #includes are assumed to be system headers
+class TermPrefilter {
+    struct ScannedFile {
+        bool hasTerm, computedInclude;
+        //include names as spelled, and whether they are angled
+        std::vector<std::pair<std::string, bool>> includes;
+        ScannedFile() : hasTerm(false), computedInclude(false) {}
+    };
+
+    const TermTable *terms;
+    std::mutex cacheMutex;
+    //scanned files are shared by all the translation units (and worker threads)
+    llvm::StringMap<std::shared_ptr<ScannedFile>> cache;
+
+    //one pass over the file: every double quote is a candidate start of a literal, and the text up to the next double quote
+    //is looked up in the TermTable, so the cost does not grow with the number of terms. memchr() does the vectorized part
+    bool findTerms(StringRef text) const {
+        const char *p = text.begin(), *end = text.end();
+        size_t minLen = terms->minLength(), maxLen = terms->maxLength();
+        while (p<end && (p = (const char*)memchr(p, '"', end-p)) != NULL) {
+            ++p;
+            const char *q = (const char*)memchr(p, '"', std::min<size_t>(end-p, maxLen+1));
+            if (q!=NULL && (size_t)(q-p)>=minLen && terms->contains(StringRef(p, q-p))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void findIncludes(StringRef text, ScannedFile &sf) {
+        size_t pos = 0;
+        while ((pos = text.find('#', pos)) != StringRef::npos) {
+            size_t lineStart = text.rfind('\n', pos);
+            lineStart = lineStart==StringRef::npos ? 0 : lineStart+1;
+            bool directive = text.slice(lineStart, pos).trim().empty();
+            StringRef rest = text.substr(pos+1).ltrim(" \t");
+            ++pos;
+            if (!directive) continue;
+            if (rest.startswith("include_next")) {
+                rest = rest.drop_front(12);
+            } else if (rest.startswith("include") || rest.startswith("import")) {
+                rest = rest.drop_front(rest[1]=='n' ? 7 : 6);
+            } else {
+                continue;
+            }
+            rest = rest.ltrim(" \t");
+            char close = rest.empty() ? 0 : rest[0]=='"' ? '"' : rest[0]=='<' ? '>' : 0;
+            size_t nameEnd = close==0 ? StringRef::npos : rest.find_first_of(close=='"' ? StringRef("\"\n") : StringRef(">\n"), 1);
+            if (nameEnd==StringRef::npos || rest[nameEnd]!=close) {
+                sf.computedInclude = true;
+                continue;
+            }
+            sf.includes.push_back(std::make_pair(rest.slice(1, nameEnd).str(), close=='>'));
+        }
+    }
+
+    std::shared_ptr<ScannedFile> scan(const std::string &path) {
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            auto it = cache.find(path);
+            if (it!=cache.end()) return it->second;
+        }
+        //big files are mmapped by MemoryBuffer
+        auto buffer = llvm::MemoryBuffer::getFile(path, -1, /*RequiresNullTerminator=*/false);
+        if (!buffer) return std::shared_ptr<ScannedFile>();
+        std::shared_ptr<ScannedFile> sf = std::make_shared<ScannedFile>();
+        StringRef text = (*buffer)->getBuffer();
+        sf->hasTerm = findTerms(text);
+        if (!sf->hasTerm) {
+            findIncludes(text, *sf);
+        }
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        cache[path] = sf;
+        return sf;
+    }
+
+public:
+    TermPrefilter(const TermTable *t) : terms(t) {}
+
+    //false if the translation unit certainly does not contain any of the terms
+    bool mayContainTerms(const CompileCommand &command, const std::string &mainFile) {
+        IncludePaths paths = getIncludePaths(command);
+        std::vector<std::string> pending(1, mainFile);
+        for (const std::string &forced : paths.forced) {
+            pending.push_back(forced);
+        }
+        llvm::StringSet<> seen;
+        for (const std::string &path : pending) {
+            seen.insert(path);
+        }
+        while (!pending.empty()) {
+            std::string path = pending.back();
+            pending.pop_back();
+            std::shared_ptr<ScannedFile> sf = scan(path);
+            if (!sf || sf->hasTerm || sf->computedInclude) return true;
+            StringRef includerDir = llvm::sys::path::parent_path(path);
+            for (auto &include : sf->includes) {
+                std::string resolved;
+                if (resolveInclude(include.first, include.second, includerDir, paths, resolved) && seen.insert(resolved).second) {
+                    pending.push_back(resolved);
+                }
+            }
+        }
+        return false;
+    }
+};
+
+//everything a translation unit produces, handed over from the worker that parsed it to the writer stage
+struct TUResult {
+  std::string mainFile;
+  //original contents of the main file, only if the writer stage prints it (OutputFile), or diffs its edits (OutputDiff)
+  std::string mainFileContents;
+  OutputMode output;
+  bool keepContents;
+  std::vector<FileEdits> fileEdits;
+  TUStats stats;
+  int status;
+  //true if the prefilter found that the translation unit did not need to be parsed
+  bool skipped;
+  bool done;
+  TUResult() : output(OutputFile), keepContents(false), status(0), skipped(false), done(false) {}
 };
 
 // For each source file provided to the tool, a new FrontendAction is created.
 class MyFrontendAction : public ASTFrontendAction {
 public:
-  MyFrontendAction() {}
-  ~MyFrontendAction() {
-      if (Overwrite.getValue()) {
-          //this overwrite changes to source files, both the source file and the included headers
-          llvm::errs() << "Overwriting files...\n";
-          TheRewriter.overwriteChangedFiles();
-          llvm::errs() << "Overwrite complete.\n";
-      }
+  MyFrontendAction(TUResult *r) : result(r) {}
+
+  bool BeginSourceFileAction(CompilerInstance &CI) override {
+      start = StatsClock::now();
+      ownPhasesBefore = ownPhases();
+      return true;
   }
+
   void EndSourceFileAction() override {
-      if (!Overwrite.getValue()) {
-        TheRewriter.getEditBuffer(TheRewriter.getSourceMgr().getMainFileID()).write(llvm::outs());
+      //files are not written here: the worker threads hand over their edits to the writer stage in main()
+      StatsClock::time_point collect = StatsClock::now();
+      SourceManager &SM = TheEdits.getSourceMgr();
+      FileID mainFID = SM.getMainFileID();
+      if (const FileEntry *mainEntry = SM.getFileEntryForID(mainFID)) {
+        result->mainFile = getCanonicalPath(mainEntry->getName());
+      }
+      TheEdits.getFileEdits(result->fileEdits);
+      if (result->keepContents) {
+        //a diff only needs the main file if it has edits
+        bool edited = result->output==OutputFile;
+        for (const FileEdits &fe : result->fileEdits) {
+          edited = edited || fe.path==result->mainFile;
+        }
+        if (edited) {
+          result->mainFileContents = SM.getBufferData(mainFID);
+        }
       }
+      TUStats &stats = result->stats;
+      stats.ms[PhaseRewrite] += msSince(collect);
+      //whatever the frontend did apart from our own phases
+      stats.ms[PhaseParse] += msSince(start)-(ownPhases()-ownPhasesBefore);
   }
 
   std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, StringRef file) override {
-    TheRewriter.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
-    refactorTool.setRewriter(&TheRewriter);
-    return llvm::make_unique<MyASTConsumer>(&refactorTool);
+    TheEdits.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
+    refactorTool.setEditCollector(&TheEdits);
+    auto consumer = llvm::make_unique<MyASTConsumer>(&refactorTool, &Terms, &result->stats);
+    //the uses of the dead booleans may be anywhere
+    if (SkipBodies.getValue() && !RemoveDeadBools.getValue()) {
+      //ParseAST() reads this after the consumer has been created
+      CI.getFrontendOpts().SkipFunctionBodies = true;
+      consumer->setBodySkipper(llvm::make_unique<FunctionBodySkipper>(CI.getSourceManager(), CI.getLangOpts(), CI.getPreprocessor(), &Terms));
+    }
+    return std::move(consumer);
   }
 
 private:
-  Rewriter TheRewriter;
+  double ownPhases() const { return result->stats.ms[PhaseMatch]+result->stats.ms[PhaseClassify]+result->stats.ms[PhaseRewrite]; }
+
+  TUResult *result;
+  StatsClock::time_point start;
+  double ownPhasesBefore;
+  EditCollector TheEdits;
   RefactorEngine refactorTool;
 };
 
-int main(int argc, const char **argv) {
-  CommonOptionsParser op(argc, argv, CustomOptions);
-  ClangTool Tool(op.getCompilations(), op.getSourcePathList());
+class MyFrontendActionFactory : public FrontendActionFactory {
+public:
+  MyFrontendActionFactory(TUResult *r) : result(r) {}
+  FrontendAction *create() override { return new MyFrontendAction(result); }
+private:
+  TUResult *result;
+};
+
+LLVM_YAML_IS_SEQUENCE_VECTOR(SourceEdit)
+LLVM_YAML_IS_SEQUENCE_VECTOR(FileEdits)
+
+namespace llvm {
+namespace yaml {
+template <> struct MappingTraits<SourceEdit> {
+  static void mapping(IO &io, SourceEdit &e) {
+    io.mapRequired("Offset", e.offset);
+    io.mapRequired("Length", e.length);
+    io.mapRequired("ReplacementText", e.text);
+  }
+};
+template <> struct MappingTraits<FileEdits> {
+  static void mapping(IO &io, FileEdits &f) {
+    io.mapRequired("FilePath", f.path);
+    io.mapRequired("ContentHash", f.hash);
+    io.mapRequired("Edits", f.edits);
+  }
+};
+} // namespace yaml
+} // namespace llvm
+
+//write to a temporary file in the same directory and rename it, so the file is never left half-written. The contents are streamed by write
+static bool writeFileAtomically(StringRef path, llvm::function_ref<void(raw_ostream&)> write) {
+  int fd;
+  SmallString<128> tmpPath;
+  if (std::error_code EC = llvm::sys::fs::createUniqueFile(path + "-%%%%%%%%", fd, tmpPath)) {
+    llvm::errs() << "Cannot create temporary file for " << path << ": " << EC.message() << "\n";
+    return false;
+  }
+  {
+    llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+    write(out);
+    out.close();
+    if (out.has_error()) {
+      llvm::errs() << "Cannot write " << tmpPath << "\n";
+      out.clear_error();
+      llvm::sys::fs::remove(tmpPath);
+      return false;
+    }
+  }
+  if (std::error_code EC = llvm::sys::fs::rename(tmpPath, path)) {
+    llvm::errs() << "Cannot overwrite " << path << ": " << EC.message() << "\n";
+    llvm::sys::fs::remove(tmpPath);
+    return false;
+  }
+  return true;
+}
 
-  return Tool.run(newFrontendActionFactory<MyFrontendAction>().get());
+static bool writeFileAtomically(StringRef path, StringRef contents) {
+  return writeFileAtomically(path, [&](raw_ostream &out) { out << contents; });
+}
+
+//Merge stage for the edits of all translation units (and/or edit sets exported by previous runs): identical edits are applied
+//just once, conflicting ones are reported (the first one in command line order wins), and each file is written just once
+class EditMerger {
+  struct MergedFile {
+    uint64_t hash;
+    std::string firstOrigin;
+    std::vector<SourceEdit> edits;
+  };
+  llvm::StringMap<MergedFile> files;
+  std::vector<std::string> order;
+  unsigned numDuplicates, numConflicts;
+
+public:
+  EditMerger() : numDuplicates(0), numConflicts(0) {}
+
+  unsigned conflicts() const { return numConflicts; }
+
+  //if accepted is not NULL, the edits that were not there yet are appended to it
+  void add(const FileEdits &fe, StringRef origin, std::vector<SourceEdit> *accepted = NULL) {
+    auto it = files.find(fe.path);
+    if (it==files.end()) {
+      MergedFile &mf = files[fe.path];
+      mf.hash = fe.hash;
+      mf.firstOrigin = origin;
+      mf.edits = fe.edits;
+      order.push_back(fe.path);
+      if (accepted!=NULL) {
+        accepted->insert(accepted->end(), fe.edits.begin(), fe.edits.end());
+      }
+      return;
+    }
+    MergedFile &mf = it->second;
+    if (mf.hash!=fe.hash) {
+      ++numConflicts;
+      llvm::errs() << "CONFLICT: " << fe.path << " had different contents for " << mf.firstOrigin << " and " << origin << ", ignoring the edits from the latter\n";
+      return;
+    }
+    for (const SourceEdit &e : fe.edits) {
+      auto pos = std::lower_bound(mf.edits.begin(), mf.edits.end(), e, [](const SourceEdit &a, const SourceEdit &b) { return a.offset<b.offset || (a.offset==b.offset && a.length<b.length); });
+      if (pos!=mf.edits.end() && *pos==e) {
+        ++numDuplicates;
+        continue;
+      }
+      bool overlapsPrev = pos!=mf.edits.begin() && (pos-1)->end()>e.offset;
+      bool overlapsNext = pos!=mf.edits.end() && (pos->offset<e.end() || pos->offset==e.offset);
+      if (overlapsPrev || overlapsNext) {
+        ++numConflicts;
+        llvm::errs() << "CONFLICT: edit at offset " << e.offset << " in " << fe.path << " from " << origin << " overlaps a different edit from a previous translation unit, ignoring it\n";
+        continue;
+      }
+      mf.edits.insert(pos, e);
+      if (accepted!=NULL) {
+        accepted->push_back(e);
+      }
+    }
+  }
+
+  //the merged edits of a file, or NULL if there are none
+  const std::vector<SourceEdit> *getEdits(StringRef path) const {
+    auto it = files.find(path);
+    return it==files.end() ? NULL : &it->second.edits;
+  }
+
+  bool addFromYAML(StringRef yamlPath) {
+    auto buffer = llvm::MemoryBuffer::getFile(yamlPath);
+    if (!buffer) {
+      llvm::errs() << "Cannot read edits file " << yamlPath << ": " << buffer.getError().message() << "\n";
+      return false;
+    }
+    std::vector<FileEdits> fileEdits;
+    llvm::yaml::Input yin((*buffer)->getBuffer());
+    yin >> fileEdits;
+    if (yin.error()) {
+      llvm::errs() << "Cannot parse edits file " << yamlPath << "\n";
+      return false;
+    }
+    for (const FileEdits &fe : fileEdits) {
+      add(fe, yamlPath);
+    }
+    return true;
+  }
+
+  //the merged edits, in the order the files were first seen
+  std::vector<FileEdits> getFileEdits() const {
+    std::vector<FileEdits> fileEdits;
+    for (const std::string &path : order) {
+      const MergedFile &mf = files.find(path)->second;
+      FileEdits fe;
+      fe.path = path;
+      fe.hash = mf.hash;
+      fe.edits = mf.edits;
+      fileEdits.push_back(std::move(fe));
+    }
+    return fileEdits;
+  }
+
+  bool exportYAML(StringRef yamlPath) {
+    std::vector<FileEdits> fileEdits = getFileEdits();
+    std::error_code EC;
+    llvm::raw_fd_ostream out(yamlPath, EC, llvm::sys::fs::F_None);
+    if (EC) {
+      llvm::errs() << "Cannot write edits file " << yamlPath << ": " << EC.message() << "\n";
+      return false;
+    }
+    llvm::yaml::Output yout(out);
+    yout << fileEdits;
+    return true;
+  }
+
+  bool writeFiles() {
+    bool ok = true;
+    //this overwrite changes to source files, both the source files and the included headers
+    llvm::errs() << "Overwriting files...\n";
+    for (const std::string &path : order) {
+      const MergedFile &mf = files[path];
+      if (mf.edits.empty()) continue;
+      auto buffer = llvm::MemoryBuffer::getFile(path);
+      if (!buffer) {
+        llvm::errs() << "Cannot read " << path << ": " << buffer.getError().message() << "\n";
+        ok = false;
+        continue;
+      }
+      StringRef contents = (*buffer)->getBuffer();
+      if (hashContents(contents)!=mf.hash) {
+        llvm::errs() << "CONFLICT: " << path << " has changed since it was parsed, not overwriting it\n";
+        ++numConflicts;
+        ok = false;
+        continue;
+      }
+      //files whose edits cancel out are not touched either
+      std::string rewritten = applyEdits(contents, mf.edits);
+      if (rewritten==contents) continue;
+      ok = writeFileAtomically(path, rewritten) && ok;
+    }
+    llvm::errs() << "Overwrite complete (" << order.size() << " files, " << numDuplicates << " duplicated edits, " << numConflicts << " conflicts).\n";
+    return ok;
+  }
+};
+
+//--output=yaml/diff: prints the edits of each translation unit as soon as the writer stage gets them. Files edited by several translation
+//units (typically, shared headers) are merged as in EditMerger: edits already printed for a previous translation unit are not printed
+//again, and diffs of new ones are relative to the contents with the previous ones applied, so the diffs can be applied one after another.
+//Nothing is written to disk
+class EditStreamer {
+  OutputMode mode;
+  raw_ostream &out;
+  EditMerger merger;
+  //original contents of the files printed as diffs, with the offsets where their lines start
+  struct Original {
+    std::string contents;
+    std::vector<unsigned> starts;
+  };
+  llvm::StringMap<Original> originals;
+  unsigned numChanged;
+
+public:
+  EditStreamer(OutputMode m, raw_ostream &o) : mode(m), out(o), numChanged(0) {}
+
+  unsigned conflicts() const { return merger.conflicts()+numChanged; }
+
+  //mainContents are the contents of mainFile, so it does not have to be read again
+  void add(const std::vector<FileEdits> &fileEdits, StringRef origin, StringRef mainFile, StringRef mainContents) {
+    std::vector<FileEdits> newEdits;
+    for (const FileEdits &fe : fileEdits) {
+      std::vector<SourceEdit> previous;
+      const std::vector<SourceEdit> *merged = merger.getEdits(fe.path);
+      if (mode==OutputDiff && merged!=NULL) {
+        previous = *merged;
+      }
+      FileEdits accepted;
+      accepted.path = fe.path;
+      accepted.hash = fe.hash;
+      merger.add(fe, origin, &accepted.edits);
+      if (accepted.edits.empty()) continue;
+      if (mode==OutputYAML) {
+        newEdits.push_back(std::move(accepted));
+        continue;
+      }
+      auto it = originals.find(fe.path);
+      if (it==originals.end()) {
+        std::string contents;
+        if (fe.path==mainFile) {
+          contents = mainContents;
+        } else if (auto buffer = llvm::MemoryBuffer::getFile(fe.path)) {
+          contents = (*buffer)->getBuffer();
+        } else {
+          llvm::errs() << "Cannot read " << fe.path << ": " << buffer.getError().message() << "\n";
+          continue;
+        }
+        if (hashContents(contents)!=fe.hash) {
+          llvm::errs() << "CONFLICT: " << fe.path << " has changed since it was parsed, not printing its edits\n";
+          ++numChanged;
+          continue;
+        }
+        it = originals.insert(std::make_pair(fe.path, Original())).first;
+        it->second.contents = std::move(contents);
+        getLineStarts(it->second.contents, it->second.starts);
+      }
+      writeUnifiedDiff(out, fe.path, it->second.contents, it->second.starts, previous, accepted.edits);
+    }
+    if (!newEdits.empty()) {
+      llvm::yaml::Output yout(out);
+      yout << newEdits;
+    }
+    out.flush();
+  }
+};
+
+//--pch-cache: translation units with the same compiler arguments that start with the same #includes get them from a precompiled header,
+//built just once for all of them. With -include-pch, the #includes in the main file are skipped by their include guards, so their text is
+//not parsed again. The declarations from the precompiled header are traversed as any others, and their locations are in the headers, so
+//call sites in the headers are refactored as without it. Precompiled headers are kept in the cache directory, named after a hash of the
+//compiler arguments and the contents of the #included headers, with the hashes of all the files they read: clang's own check (modification
+//times) is disabled, and a precompiled header is built again if any of these files has changed
+class SharedPCH {
+    //translation units with the same compiler arguments and the same first #include
+    struct Group {
+        CompileCommand command;
+        //compiler arguments without the input file
+        CommandLineArguments args;
+        bool isC;
+        std::vector<std::string> tus;
+        //for each translation unit, its leading #includes as they are written in the generated header: "/absolute/path" or <name>
+        std::vector<std::vector<std::string>> includes;
+    };
+
+    //generates the precompiled header, and collects what is needed to reuse it: the files it read, and the first of the #includes (one per
+    //line in the generated header) that is not guarded against multiple inclusion: its text would be parsed again in each translation unit
+    class BuildPCHAction : public GeneratePCHAction {
+        std::string output;
+        unsigned &firstUnguarded;
+        std::vector<std::string> &deps;
+    public:
+        BuildPCHAction(StringRef o, unsigned &u, std::vector<std::string> &d) : output(o), firstUnguarded(u), deps(d) {}
+    protected:
+        bool BeginInvocation(CompilerInstance &CI) override {
+            CI.getFrontendOpts().OutputFile = output;
+            return true;
+        }
+        void EndSourceFileAction() override {
+            CompilerInstance &CI = getCompilerInstance();
+            SourceManager &SM = CI.getSourceManager();
+            HeaderSearch &HS = CI.getPreprocessor().getHeaderSearchInfo();
+            for (unsigned i = 0; i < SM.local_sloc_entry_size(); ++i) {
+                const SrcMgr::SLocEntry &entry = SM.getLocalSLocEntry(i);
+                if (!entry.isFile()) continue;
+                SourceLocation includeLoc = entry.getFile().getIncludeLoc();
+                if (includeLoc.isInvalid() || SM.getFileID(includeLoc)!=SM.getMainFileID()) continue;
+                const FileEntry *file = entry.getFile().getContentCache()->OrigEntry;
+                if (file!=NULL && !HS.isFileMultipleIncludeGuarded(file)) {
+                    firstUnguarded = std::min(firstUnguarded, SM.getSpellingLineNumber(includeLoc)-1);
+                }
+            }
+            SmallVector<const FileEntry*, 256> entries;
+            CI.getFileManager().GetUniqueIDMapping(entries);
+            for (const FileEntry *entry : entries) {
+                if (entry!=NULL) {
+                    //still in the directory of the compile command, which relative names are relative to
+                    deps.push_back(getCanonicalPath(entry->getName()));
+                }
+            }
+            GeneratePCHAction::EndSourceFileAction();
+        }
+    };
+
+    std::string cacheDir;
+    unsigned maxIncludes;
+    std::string resourcesPath;
+    //the precompiled header of each translation unit that uses one
+    llvm::StringMap<std::string> pchForTU;
+    unsigned numBuilt, numReused, numFailed;
+
+    //the #includes at the start of a main file, with only blank lines and comments before and between them
+    static void getLeadingIncludes(StringRef text, unsigned max, std::vector<std::pair<std::string, bool>> &includes) {
+        size_t pos = 0;
+        while (includes.size()<max) {
+            pos = text.find_first_not_of(" \t\r\n", pos);
+            if (pos==StringRef::npos) return;
+            StringRef rest = text.substr(pos);
+            if (rest.startswith("//")) {
+                pos = text.find('\n', pos);
+                if (pos==StringRef::npos) return;
+                continue;
+            }
+            if (rest.startswith("/*")) {
+                pos = text.find("*/", pos+2);
+                if (pos==StringRef::npos) return;
+                pos += 2;
+                continue;
+            }
+            if (!rest.startswith("#")) return;
+            rest = rest.drop_front(1).ltrim(" \t");
+            if (!rest.startswith("include") || rest.startswith("include_next")) return;
+            rest = rest.drop_front(7).ltrim(" \t");
+            char close = rest.startswith("\"") ? '"' : rest.startswith("<") ? '>' : 0;
+            size_t nameEnd = close==0 ? StringRef::npos : rest.find_first_of(close=='"' ? StringRef("\"\n") : StringRef(">\n"), 1);
+            if (nameEnd==StringRef::npos || rest[nameEnd]!=close) return;
+            //nothing else in the line but blanks or a line comment
+            StringRef tail = rest.substr(nameEnd+1);
+            tail = tail.substr(0, tail.find('\n')).trim();
+            if (!tail.empty() && !tail.startswith("//")) return;
+            includes.push_back(std::make_pair(rest.slice(1, nameEnd).str(), close=='>'));
+            pos = text.find('\n', (rest.data()-text.data())+nameEnd+1);
+            if (pos==StringRef::npos) return;
+        }
+    }
+
+    static bool hashFile(StringRef path, uint64_t &hash) {
+        auto buffer = llvm::MemoryBuffer::getFile(path, -1, /*RequiresNullTerminator=*/false);
+        if (!buffer) return false;
+        hash = hashContents((*buffer)->getBuffer());
+        return true;
+    }
+
+    //true if all the files read to build the precompiled header (listed in the .deps file, with their hashes) are still the same
+    static bool isUpToDate(StringRef depsPath) {
+        auto buffer = llvm::MemoryBuffer::getFile(depsPath);
+        if (!buffer) return false;
+        SmallVector<StringRef, 256> lines;
+        (*buffer)->getBuffer().split(lines, '\n', -1, false);
+        for (StringRef line : lines) {
+            std::pair<StringRef, StringRef> split = line.split(' ');
+            uint64_t expected, hash;
+            if (split.first.getAsInteger(16, expected) || !hashFile(split.second, hash) || hash!=expected) return false;
+        }
+        return !lines.empty();
+    }
+
+    //the .pch file for the #includes of a group (building it if it is not in the cache), or an empty string if it cannot be built. Only
+    //the #includes before the first one without include guard are precompiled; if there is one, the .prefix file records how many they are
+    std::string getPCH(const Group &group, std::vector<std::string> includes) {
+        std::string keyText;
+        for (const std::string &arg : group.args) {
+            keyText += arg;
+            keyText += '\0';
+        }
+        keyText += group.command.Directory;
+        for (const std::string &include : includes) {
+            keyText += '\0';
+            keyText += include;
+            if (include[0]=='"') {
+                uint64_t hash;
+                if (!hashFile(include.substr(1, include.size()-2), hash)) return std::string();
+                keyText += '\0';
+                keyText += llvm::utohexstr(hash);
+            }
+        }
+        SmallString<256> base(cacheDir);
+        llvm::sys::path::append(base, llvm::utohexstr(llvm::xxHash64(keyText)));
+        std::string headerPath = base.str().str()+".h", pchPath = base.str().str()+".pch", depsPath = base.str().str()+".deps", prefixPath = base.str().str()+".prefix";
+        if (auto prefix = llvm::MemoryBuffer::getFile(prefixPath)) {
+            unsigned n;
+            if (!(*prefix)->getBuffer().trim().getAsInteger(10, n) && n>0 && n<includes.size()) {
+                includes.resize(n);
+                return getPCH(group, includes);
+            }
+        }
+        if (llvm::sys::fs::exists(pchPath) && isUpToDate(depsPath)) {
+            ++numReused;
+            return pchPath;
+        }
+        std::string text;
+        for (const std::string &include : includes) {
+            text += "#include " + include + "\n";
+        }
+        if (!writeFileAtomically(headerPath, text)) return std::string();
+        CommandLineArguments args = group.args;
+        //the same builtin headers as the translation units run by ClangTool, which looks for them next to this executable
+        args.push_back("-resource-dir=" + resourcesPath);
+        args.push_back(group.isC ? "-xc-header" : "-xc++-header");
+        args.push_back(headerPath);
+        //as in ClangTool::run(), relative paths in the compile command are relative to its directory, and the previous one is restored afterwards
+        SmallString<256> previousDir;
+        if (std::error_code EC = llvm::sys::fs::current_path(previousDir)) {
+            llvm::errs() << "Cannot get the working directory: " << EC.message() << "\n";
+            return std::string();
+        }
+        if (::chdir(group.command.Directory.c_str())!=0) {
+            llvm::errs() << "Cannot change to directory " << group.command.Directory << "\n";
+            return std::string();
+        }
+        unsigned firstUnguarded = includes.size();
+        std::vector<std::string> deps;
+        llvm::IntrusiveRefCntPtr<FileManager> Files(new FileManager(FileSystemOptions()));
+        ToolInvocation invocation(args, new BuildPCHAction(pchPath, firstUnguarded, deps), Files.get());
+        bool built = invocation.run();
+        if (::chdir(previousDir.c_str())!=0) {
+            llvm::errs() << "Cannot change back to directory " << previousDir << "\n";
+            return std::string();
+        }
+        if (built && firstUnguarded<includes.size()) {
+            llvm::sys::fs::remove(pchPath);
+            if (firstUnguarded==0 || !writeFileAtomically(prefixPath, llvm::utostr(firstUnguarded)+"\n")) return std::string();
+            includes.resize(firstUnguarded);
+            return getPCH(group, includes);
+        }
+        if (!built) {
+            llvm::sys::fs::remove(pchPath);
+            return std::string();
+        }
+        //written last: a .deps file means that its .pch file is complete
+        std::string depsText;
+        for (const std::string &dep : deps) {
+            uint64_t hash;
+            if (!hashFile(dep, hash)) return std::string();
+            depsText += llvm::utohexstr(hash) + " " + dep + "\n";
+        }
+        if (!writeFileAtomically(depsPath, depsText)) return std::string();
+        ++numBuilt;
+        return pchPath;
+    }
+
+public:
+    SharedPCH(StringRef dir, unsigned max, StringRef resources)
+        : cacheDir(getAbsolutePath(dir)), maxIncludes(max), resourcesPath(resources), numBuilt(0), numReused(0), numFailed(0) {}
+
+    //find the #includes shared by the translation units, and get a precompiled header for each group of them
+    void prepare(const CompilationDatabase &Compilations, const std::vector<std::string> &files) {
+        if (std::error_code EC = llvm::sys::fs::create_directories(cacheDir)) {
+            llvm::errs() << "Cannot create " << cacheDir << ": " << EC.message() << "\n";
+            return;
+        }
+        std::map<std::string, Group> groups;
+        for (const std::string &file : files) {
+            std::vector<CompileCommand> commands = Compilations.getCompileCommands(file);
+            if (commands.empty()) continue;
+            const CompileCommand &command = commands[0];
+            CommandLineArguments args = getClangSyntaxOnlyAdjuster()(command.CommandLine, file);
+            args = getClangStripOutputAdjuster()(args, file);
+            args = getClangStripDependencyFileAdjuster()(args, file);
+            CommandLineArguments flags;
+            bool forcedIncludes = false;
+            for (size_t i = 0; i < args.size(); ++i) {
+                //files included before the main file would come before the precompiled header
+                if (StringRef(args[i]).startswith("-include") || StringRef(args[i]).startswith("-imacros")) forcedIncludes = true;
+                if (i>0 && absoluteIn(command.Directory, args[i])==absoluteIn(command.Directory, file)) continue;
+                flags.push_back(args[i]);
+            }
+            if (forcedIncludes) continue;
+            auto buffer = llvm::MemoryBuffer::getFile(file, -1, /*RequiresNullTerminator=*/false);
+            if (!buffer) continue;
+            std::vector<std::pair<std::string, bool>> leading;
+            getLeadingIncludes((*buffer)->getBuffer(), maxIncludes, leading);
+            IncludePaths paths = getIncludePaths(command);
+            std::vector<std::string> includes;
+            for (auto &include : leading) {
+                std::string resolved;
+                if (resolveInclude(include.first, include.second, llvm::sys::path::parent_path(file), paths, resolved)) {
+                    includes.push_back("\"" + getCanonicalPath(resolved) + "\"");
+                } else if (include.second) {
+                    //a system header: the same one for all the translation units with the same compiler arguments
+                    includes.push_back("<" + include.first + ">");
+                } else {
+                    break;
+                }
+            }
+            if (includes.empty()) continue;
+            std::string key = command.Directory;
+            for (const std::string &flag : flags) {
+                key += '\0';
+                key += flag;
+            }
+            key += '\0';
+            key += includes[0];
+            Group &group = groups[key];
+            if (group.tus.empty()) {
+                group.command = command;
+                group.args = flags;
+                group.isC = llvm::sys::path::extension(file)==".c";
+            }
+            group.tus.push_back(file);
+            group.includes.push_back(std::move(includes));
+        }
+        for (auto &g : groups) {
+            Group &group = g.second;
+            if (group.tus.size()<2) continue;
+            //the longest sequence of #includes that all of them start with
+            std::vector<std::string> common = group.includes[0];
+            for (const std::vector<std::string> &includes : group.includes) {
+                size_t n = 0;
+                while (n<common.size() && n<includes.size() && common[n]==includes[n]) ++n;
+                common.resize(n);
+            }
+            std::string pch = getPCH(group, common);
+            if (pch.empty()) {
+                llvm::errs() << "WARNING: cannot precompile the #includes shared by " << group.tus.size() << " translation units like " << group.tus[0] << ", parsing them in each one\n";
+                ++numFailed;
+                continue;
+            }
+            for (const std::string &tu : group.tus) {
+                pchForTU[tu] = pch;
+            }
+        }
+        llvm::errs() << "Shared PCH: " << pchForTU.size() << " of " << files.size() << " translation units use a precompiled header (" << numBuilt << " built, " << numReused << " reused from " << cacheDir << ", " << numFailed << " failed)\n";
+    }
+
+    //the arguments to use the precompiled header of a translation unit (none if it has not got one)
+    CommandLineArguments getArguments(StringRef file) const {
+        auto it = pchForTU.find(file);
+        if (it==pchForTU.end()) return CommandLineArguments();
+        //it is validated by hashing all the files it read, so clang's check of their modification times would only reject good ones
+        return {"-include-pch", it->getValue(), "-Xclang", "-fno-validate-pch"};
+    }
+};
+
+//how runWorkers() processes the translation units
+struct WorkerOptions {
+  unsigned jobs;
+  //if false, the edits are printed (as given by output), instead of handing them to the merger
+  bool mergeEdits;
+  OutputMode output;
+  bool prefilter;
+  //if not NULL, contents to parse instead of the files on disk, by canonical path
+  const llvm::StringMap<std::string> *overlay;
+  //if not NULL, filled with the translation units that produced edits, in order
+  std::vector<std::string> *editedTUs;
+  //if not NULL, the --stats of each translation unit are appended here, in order
+  std::vector<TUStats> *stats;
+  //if not NULL, the translation units that have a shared precompiled header use it
+  const SharedPCH *pch;
+  WorkerOptions() : jobs(1), mergeEdits(false), output(OutputFile), prefilter(false), overlay(NULL), editedTUs(NULL), stats(NULL), pch(NULL) {}
+};
+
+//parse and refactor the translation units in a pool of worker threads, each one with its own ClangTool, EditCollector and RefactorEngine.
+//The results go to a single writer stage that consumes them in command line order, so the output does not depend on thread scheduling
+static int runWorkers(const CompilationDatabase &Compilations, const std::vector<std::string> &files, const WorkerOptions &options, EditMerger &merger) {
+  std::vector<TUResult> results(files.size());
+  std::mutex resultsMutex;
+  std::condition_variable resultsReady;
+  int status = 0;
+  unsigned numSkipped = 0;
+  TermPrefilter prefilter(&Terms);
+  EditStreamer streamer(options.output, llvm::outs());
+  llvm::ThreadPool Pool(options.jobs);
+  for (size_t i = 0; i < files.size(); ++i) {
+    Pool.async([&, i]() {
+      TUResult result;
+      result.mainFile = files[i];
+      result.stats.file = files[i];
+      result.output = options.output;
+      result.keepContents = !options.mergeEdits && options.output!=OutputYAML;
+      std::vector<CompileCommand> commands = Compilations.getCompileCommands(files[i]);
+      if (options.prefilter && !commands.empty() && !prefilter.mayContainTerms(commands[0], files[i])) {
+        result.skipped = true;
+        result.stats.skipped = true;
+        if (!options.mergeEdits && options.output==OutputFile) {
+          if (auto buffer = llvm::MemoryBuffer::getFile(files[i])) {
+            result.mainFileContents = (*buffer)->getBuffer();
+          }
+        }
+      } else {
+        ClangTool Tool(Compilations, files[i]);
+        //chdir is process-wide, restoring it from several threads would race
+        Tool.setRestoreWorkingDir(false);
+        if (options.overlay!=NULL) {
+          for (auto &file : *options.overlay) {
+            Tool.mapVirtualFile(file.getKey(), file.getValue());
+          }
+        }
+        if (options.pch!=NULL) {
+          CommandLineArguments pchArgs = options.pch->getArguments(files[i]);
+          if (!pchArgs.empty()) {
+            Tool.appendArgumentsAdjuster(getInsertArgumentAdjuster(pchArgs, ArgumentInsertPosition::BEGIN));
+          }
+        }
+        MyFrontendActionFactory factory(&result);
+        result.status = Tool.run(&factory);
+      }
+      std::lock_guard<std::mutex> lock(resultsMutex);
+      results[i] = std::move(result);
+      results[i].done = true;
+      resultsReady.notify_one();
+    });
+  }
+  for (size_t i = 0; i < files.size(); ++i) {
+    {
+      std::unique_lock<std::mutex> lock(resultsMutex);
+      resultsReady.wait(lock, [&]() { return results[i].done; });
+    }
+    TUResult &result = results[i];
+    status = std::max(status, result.status);
+    if (result.skipped) {
+      ++numSkipped;
+    }
+    if (options.editedTUs!=NULL && !result.fileEdits.empty()) {
+      options.editedTUs->push_back(files[i]);
+    }
+    if (options.mergeEdits) {
+      //files are not overwritten until all the translation units have been parsed, so all of them see the original contents
+      for (const FileEdits &fe : result.fileEdits) {
+        merger.add(fe, result.mainFile);
+      }
+    } else {
+      StatsClock::time_point start = StatsClock::now();
+      if (options.output!=OutputFile) {
+        streamer.add(result.fileEdits, result.mainFile, result.mainFile, result.mainFileContents);
+      } else {
+        std::vector<SourceEdit> mainEdits;
+        for (const FileEdits &fe : result.fileEdits) {
+          if (fe.path==result.mainFile) {
+            mainEdits = fe.edits;
+          }
+        }
+        llvm::outs() << applyEdits(result.mainFileContents, mainEdits);
+      }
+      result.stats.ms[PhaseWrite] += msSince(start);
+    }
+    if (options.stats!=NULL) {
+      options.stats->push_back(std::move(result.stats));
+    }
+    //do not keep the results of all translation units until the end
+    result = TUResult();
+    result.done = true;
+  }
+  Pool.wait();
+  if (options.prefilter) {
+    llvm::errs() << "Prefilter: " << files.size()-numSkipped << " translation units parsed, " << numSkipped << " skipped (no term in them or in their #includes)\n";
+  }
+  if (streamer.conflicts()>0) {
+    status = std::max(status, 1);
+  }
+  return status;
+}
+
+//--fixed-point: refactor the translation units, then refactor again the ones that produced edits, with the rewritten files mapped in memory
+//instead of the ones on disk, until no more edits come out. The edits of all the iterations are composed into edits of the original files,
+//which go to the merger (or are printed, as in runWorkers()), so nothing is written to disk until the last iteration is done.
+//Only the translation units with edits are parsed again: the others did not see any call site, so they cannot see the literals written in their place
+static int runFixedPoint(const CompilationDatabase &Compilations, const std::vector<std::string> &files, WorkerOptions options, EditMerger &merger) {
+  struct RewrittenFile {
+    std::string original;
+    //edits of all the iterations so far, relative to original
+    std::vector<SourceEdit> edits;
+  };
+  llvm::StringMap<RewrittenFile> rewritten;
+  std::vector<std::string> rewrittenOrder;
+  //current contents of the rewritten files
+  llvm::StringMap<std::string> overlay;
+  bool print = !options.mergeEdits;
+  std::vector<std::string> pending = files, edited;
+  options.mergeEdits = true;
+  options.overlay = &overlay;
+  options.editedTUs = &edited;
+  int status = 0;
+  unsigned iteration = 0;
+  while (!pending.empty()) {
+    if (iteration==MaxIterations.getValue()) {
+      llvm::errs() << "WARNING: no fixed point after " << iteration << " iterations, " << pending.size() << " translation units still had edits\n";
+      break;
+    }
+    ++iteration;
+    EditMerger iterationMerger;
+    edited.clear();
+    status = std::max(status, runWorkers(Compilations, pending, options, iterationMerger));
+    if (iterationMerger.conflicts()>0) {
+      status = std::max(status, 1);
+    }
+    FoldedLiterals.clear();
+    for (const FileEdits &fe : iterationMerger.getFileEdits()) {
+      auto current = overlay.find(fe.path);
+      if (current==overlay.end()) {
+        auto buffer = llvm::MemoryBuffer::getFile(fe.path);
+        if (!buffer) {
+          llvm::errs() << "Cannot read " << fe.path << ": " << buffer.getError().message() << "\n";
+          status = std::max(status, 1);
+          continue;
+        }
+        current = overlay.insert(std::make_pair(fe.path, (*buffer)->getBuffer().str())).first;
+        rewritten[fe.path].original = current->second;
+        rewrittenOrder.push_back(fe.path);
+      }
+      if (hashContents(current->second)!=fe.hash) {
+        llvm::errs() << "CONFLICT: " << fe.path << " has changed during the fixed-point iterations, ignoring its edits\n";
+        status = std::max(status, 1);
+        continue;
+      }
+      //offsets of the literals in the rewritten contents
+      std::set<unsigned> &literals = FoldedLiterals[fe.path];
+      int shift = 0;
+      for (const SourceEdit &e : fe.edits) {
+        if (e.text=="true" || e.text=="false") {
+          literals.insert(e.offset+shift);
+        }
+        shift += (int)e.text.size()-(int)e.length;
+      }
+      RewrittenFile &rf = rewritten[fe.path];
+      rf.edits = composeEdits(current->second, rf.edits, fe.edits);
+      current->second = applyEdits(current->second, fe.edits);
+    }
+    //the prefilter looks at the files on disk, and the translation units with edits passed it anyway
+    options.prefilter = false;
+    //the precompiled headers have the original contents of the headers, not the rewritten ones
+    options.pch = NULL;
+    pending.swap(edited);
+  }
+  FoldedLiterals.clear();
+  llvm::errs() << "Fixed point: " << iteration << " iterations, " << rewrittenOrder.size() << " files rewritten\n";
+  if (print && options.output!=OutputFile) {
+    EditStreamer streamer(options.output, llvm::outs());
+    for (const std::string &path : rewrittenOrder) {
+      const RewrittenFile &rf = rewritten[path];
+      FileEdits fe;
+      fe.path = path;
+      fe.hash = hashContents(rf.original);
+      fe.edits = rf.edits;
+      streamer.add(std::vector<FileEdits>(1, fe), "--fixed-point", path, rf.original);
+    }
+    if (streamer.conflicts()>0) {
+      status = std::max(status, 1);
+    }
+  } else if (print) {
+    for (const std::string &file : files) {
+      auto current = overlay.find(getCanonicalPath(file));
+      if (current!=overlay.end()) {
+        llvm::outs() << current->second;
+      } else if (auto buffer = llvm::MemoryBuffer::getFile(file)) {
+        llvm::outs() << (*buffer)->getBuffer();
+      }
+    }
+  } else {
+    for (const std::string &path : rewrittenOrder) {
+      const RewrittenFile &rf = rewritten[path];
+      FileEdits fe;
+      fe.path = path;
+      fe.hash = hashContents(rf.original);
+      fe.edits = rf.edits;
+      merger.add(fe, "--fixed-point");
+    }
+  }
+  return status;
+}
+
+static const char *PhaseNames[NumPhases] = {"parse", "match", "classify", "rewrite", "write"};
+static const char *EditKindNames[NumEditKinds] = {"if_branch", "conditional_operator", "partial_boolean", "bool_literal"};
+static const char *BailOutNames[NumBailOutReasons] = {"unary_operator", "binary_operator", "unknown_expression", "macro", "use_case"};
+
+static void writeJSONString(raw_ostream &out, StringRef text) {
+  out << '"';
+  for (unsigned char c : text) {
+    if (c=='"' || c=='\\') {
+      out << '\\' << c;
+    } else if (c<0x20) {
+      out << llvm::format("\\u%04x", c);
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+static void writeJSONStats(raw_ostream &out, const TUStats &stats) {
+  out << "\"ms\": {";
+  for (unsigned i = 0; i < NumPhases; ++i) {
+    out << (i>0 ? ", " : "") << "\"" << PhaseNames[i] << "\": " << llvm::format("%.3f", stats.ms[i]);
+  }
+  out << "}, \"matches\": " << stats.matches << ", \"duplicates\": " << stats.duplicates << ", \"bodies_skipped\": " << stats.bodiesSkipped << ", \"bodies_parsed\": " << stats.bodiesParsed
+      << ", \"dead_declarations\": " << stats.deadDecls << ", \"edits\": {";
+  for (unsigned i = 0; i < NumEditKinds; ++i) {
+    out << (i>0 ? ", " : "") << "\"" << EditKindNames[i] << "\": " << stats.edits[i];
+  }
+  out << "}, \"bail_outs\": {";
+  for (unsigned i = 0; i < NumBailOutReasons; ++i) {
+    out << (i>0 ? ", " : "") << "\"" << BailOutNames[i] << "\": " << stats.bailOuts[i];
+  }
+  out << "}";
+}
+
+//--stats: the records of the translation units (in command line order; with --fixed-point, those of each iteration one after the other)
+//and their sum for the whole run. Writing the merged edits at the end of the run only shows up in the summary
+static bool writeStats(StringRef path, const std::vector<TUStats> &tus, double wallMs, double writeMs, unsigned conflicts) {
+  TUStats total;
+  unsigned numSkipped = 0;
+  for (const TUStats &stats : tus) {
+    total.add(stats);
+    if (stats.skipped) ++numSkipped;
+  }
+  total.ms[PhaseWrite] += writeMs;
+  std::string text;
+  llvm::raw_string_ostream out(text);
+  out << "{\n  \"summary\": {\"translation_units\": " << tus.size() << ", \"skipped\": " << numSkipped << ", \"wall_ms\": " << llvm::format("%.3f", wallMs)
+      << ", \"conflicts\": " << conflicts << ", ";
+  writeJSONStats(out, total);
+  out << "},\n  \"translation_units\": [";
+  for (size_t i = 0; i < tus.size(); ++i) {
+    out << (i>0 ? ",\n" : "\n") << "    {\"file\": ";
+    writeJSONString(out, tus[i].file);
+    out << ", \"skipped\": " << (tus[i].skipped ? "true" : "false") << ", ";
+    writeJSONStats(out, tus[i]);
+    out << "}";
+  }
+  out << "\n  ]\n}\n";
+  return writeFileAtomically(path, out.str());
+}
+
+//what the index records for each translation unit: the files it reads (except system headers) with the hashes of their contents, the calls
+//in them, and how long it took to parse it (the include graph and the costs are used to choose which translation units to refactor)
+struct IndexedTU {
+  std::string file;
+  std::vector<std::pair<std::string, uint64_t>> deps;
+  std::vector<IndexedCall> calls;
+  //milliseconds
+  unsigned cost;
+  IndexedTU() : cost(0) {}
+};
+
+//Call-site index file (index subcommand). It is an array of little-endian 32-bit words followed by a string pool, meant to be used
+//mmapped without any parsing:
+//   header:   'SRIX', version, numTerms, numFiles, numRecords, numTUs, numDeps, numRefs, stringBytes, 0
+//   terms:    numTerms x {string offset, string length, first record, number of records}, sorted by term
+//   files:    numFiles x {string offset, string length, hash low word, hash high word}
+//   records:  numRecords x {file, line, use case (ParentType)}, grouped by term
+//   TUs:      numTUs x {file, first dep, number of deps, first ref, number of refs, parse time in ms}
+//   deps:     numDeps x file, the files read by each TU
+//   refs:     numRefs x record, the records found in each TU
+//   strings:  stringBytes bytes
+//Looking up a term is a binary search over the terms table. refactor.py has a reader for this format too (class CallSiteIndex)
+class CallSiteIndex {
+  enum { HeaderWords = 10, TermWords = 4, FileWords = 4, RecordWords = 3, TUWords = 6, Version = 2 };
+  static const char *Magic() { return "SRIX"; }
+
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  uint32_t numTerms, numFiles, numRecords, numTUs, numDeps, numRefs, stringBytes;
+  const uint32_t *terms, *fileTable, *records, *tus, *deps, *refs;
+  const char *strings;
+
+  StringRef getString(const uint32_t *entry) const { return StringRef(strings+entry[0], entry[1]); }
+  StringRef getTerm(unsigned t) const { return getString(terms+t*TermWords); }
+  StringRef getFile(unsigned f) const { return getString(fileTable+f*FileWords); }
+  uint64_t getHash(unsigned f) const { return fileTable[f*FileWords+2] | ((uint64_t)fileTable[f*FileWords+3]<<32); }
+
+  //index in the terms table, or numTerms if the term is not there
+  unsigned findTerm(StringRef term) const {
+    unsigned lo = 0, hi = numTerms;
+    while (lo<hi) {
+      unsigned mid = (lo+hi)/2;
+      if (getTerm(mid)<term) {
+        lo = mid+1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo<numTerms && getTerm(lo)==term ? lo : numTerms;
+  }
+
+  IndexedCall getCall(unsigned t, unsigned r) const {
+    const uint32_t *record = records+r*RecordWords;
+    return IndexedCall(getTerm(t), getFile(record[0]), record[1], (ParentType)record[2]);
+  }
+
+public:
+  CallSiteIndex() : numTerms(0), numFiles(0), numRecords(0), numTUs(0), numDeps(0), numRefs(0), stringBytes(0) {}
+
+  bool load(StringRef path, std::string &error) {
+    auto file = llvm::MemoryBuffer::getFile(path, -1, /*RequiresNullTerminator=*/false);
+    if (!file) {
+      error = "cannot read " + path.str() + ": " + file.getError().message();
+      return false;
+    }
+    buffer = std::move(*file);
+    const uint32_t *words = (const uint32_t*)buffer->getBufferStart();
+    size_t size = buffer->getBufferSize();
+    if (size<HeaderWords*4 || memcmp(words, Magic(), 4)!=0 || words[1]!=Version) {
+      error = path.str() + " is not a call-site index (or it was written by another version)";
+      return false;
+    }
+    numTerms = words[2]; numFiles = words[3]; numRecords = words[4]; numTUs = words[5]; numDeps = words[6]; numRefs = words[7]; stringBytes = words[8];
+    terms     = words+HeaderWords;
+    fileTable = terms+numTerms*TermWords;
+    records   = fileTable+numFiles*FileWords;
+    tus       = records+numRecords*RecordWords;
+    deps      = tus+numTUs*TUWords;
+    refs      = deps+numDeps;
+    strings   = (const char*)(refs+numRefs);
+    if ((size_t)(strings-buffer->getBufferStart())+stringBytes!=size) {
+      error = path.str() + " is truncated or corrupted";
+      return false;
+    }
+    return true;
+  }
+
+  void getCalls(StringRef term, std::vector<IndexedCall> &out) const {
+    unsigned t = findTerm(term);
+    if (t==numTerms) return;
+    for (unsigned r = terms[t*TermWords+2]; r < terms[t*TermWords+2]+terms[t*TermWords+3]; ++r) {
+      out.push_back(getCall(t, r));
+    }
+  }
+
+  //the translation units, as they were when indexed (for incremental reindexing)
+  std::vector<IndexedTU> getTUs() const {
+    std::vector<unsigned> recordTerms(numRecords);
+    for (unsigned t = 0; t < numTerms; ++t) {
+      for (unsigned r = terms[t*TermWords+2]; r < terms[t*TermWords+2]+terms[t*TermWords+3]; ++r) {
+        recordTerms[r] = t;
+      }
+    }
+    std::vector<IndexedTU> result(numTUs);
+    for (unsigned u = 0; u < numTUs; ++u) {
+      const uint32_t *tu = tus+u*TUWords;
+      result[u].file = getFile(tu[0]);
+      result[u].cost = tu[5];
+      for (unsigned d = tu[1]; d < tu[1]+tu[2]; ++d) {
+        result[u].deps.push_back(std::make_pair(getFile(deps[d]).str(), getHash(deps[d])));
+      }
+      for (unsigned r = tu[3]; r < tu[3]+tu[4]; ++r) {
+        result[u].calls.push_back(getCall(recordTerms[refs[r]], refs[r]));
+      }
+    }
+    return result;
+  }
+
+  //a small set of translation units that, together, reach all the calls for the terms (including the ones in headers), preferring the ones that
+  //are cheap to parse. Minimum weighted set cover is NP-hard, so this is the usual greedy approximation: the translation unit with most calls
+  //not reached yet per millisecond of parsing is taken, until all the calls are reached. The scores only go down as calls are reached, so
+  //they are kept in a priority queue and only the one at the top is recomputed (lazy greedy): if it did not change, it is still the best one
+  std::vector<std::string> getTUsForTerms(const TermTable &table) const {
+    std::vector<bool> wanted(numRecords, false);
+    for (unsigned t = 0; t < numTerms; ++t) {
+      if (table.contains(getTerm(t))) {
+        for (unsigned r = terms[t*TermWords+2]; r < terms[t*TermWords+2]+terms[t*TermWords+3]; ++r) {
+          wanted[r] = true;
+        }
+      }
+    }
+    auto getScore = [&](unsigned u) {
+      const uint32_t *tu = tus+u*TUWords;
+      unsigned reached = 0;
+      for (unsigned r = tu[3]; r < tu[3]+tu[4]; ++r) {
+        reached += wanted[refs[r]];
+      }
+      return (double)reached/std::max(1u, tu[5]);
+    };
+    //(score, TU), the highest score first and, for the same score, the first TU
+    typedef std::pair<double, unsigned> Candidate;
+    auto worse = [](const Candidate &a, const Candidate &b) { return a.first<b.first || (a.first==b.first && a.second>b.second); };
+    std::priority_queue<Candidate, std::vector<Candidate>, decltype(worse)> candidates(worse);
+    for (unsigned u = 0; u < numTUs; ++u) {
+      double score = getScore(u);
+      if (score>0) candidates.push(Candidate(score, u));
+    }
+    std::vector<std::string> result;
+    while (!candidates.empty()) {
+      Candidate top = candidates.top();
+      candidates.pop();
+      double score = getScore(top.second);
+      if (score!=top.first) {
+        if (score>0) candidates.push(Candidate(score, top.second));
+        continue;
+      }
+      const uint32_t *tu = tus+top.second*TUWords;
+      for (unsigned r = tu[3]; r < tu[3]+tu[4]; ++r) {
+        wanted[refs[r]] = false;
+      }
+      result.push_back(getFile(tu[0]));
+    }
+    return result;
+  }
+
+  static bool write(StringRef path, const std::vector<IndexedTU> &indexed) {
+    std::string pool;
+    std::vector<uint32_t> fileWords;
+    llvm::StringMap<unsigned> fileIds;
+    auto fileId = [&](StringRef name, uint64_t hash, bool hashKnown) {
+      auto it = fileIds.find(name);
+      if (it!=fileIds.end()) {
+        if (hashKnown) {
+          fileWords[it->second*FileWords+2] = (uint32_t)hash;
+          fileWords[it->second*FileWords+3] = (uint32_t)(hash>>32);
+        }
+        return it->second;
+      }
+      unsigned id = fileIds.size();
+      fileIds[name] = id;
+      uint32_t entry[FileWords] = {(uint32_t)pool.size(), (uint32_t)name.size(), (uint32_t)hash, (uint32_t)(hash>>32)};
+      fileWords.insert(fileWords.end(), entry, entry+FileWords);
+      pool += name;
+      return id;
+    };
+    //records are deduplicated (calls in headers are found by every TU including them), and sorted by term
+    typedef std::tuple<std::string, unsigned, unsigned, unsigned> RecordKey;
+    std::map<RecordKey, unsigned> recordIds;
+    for (const IndexedTU &tu : indexed) {
+      fileId(tu.file, 0, false);
+      for (auto &dep : tu.deps) {
+        fileId(dep.first, dep.second, true);
+      }
+      for (const IndexedCall &call : tu.calls) {
+        recordIds[RecordKey(call.term, fileId(call.file, 0, false), call.line, call.kind)] = 0;
+      }
+    }
+    std::vector<uint32_t> termWords, recordWords;
+    for (auto &record : recordIds) {
+      const std::string &term = std::get<0>(record.first);
+      record.second = recordWords.size()/RecordWords;
+      if (termWords.empty() || StringRef(pool.data()+termWords[termWords.size()-TermWords], termWords[termWords.size()-TermWords+1])!=term) {
+        uint32_t entry[TermWords] = {(uint32_t)pool.size(), (uint32_t)term.size(), record.second, 0};
+        termWords.insert(termWords.end(), entry, entry+TermWords);
+        pool += term;
+      }
+      ++termWords.back();
+      uint32_t entry[RecordWords] = {std::get<1>(record.first), std::get<2>(record.first), std::get<3>(record.first)};
+      recordWords.insert(recordWords.end(), entry, entry+RecordWords);
+    }
+    std::vector<uint32_t> tuWords, depWords, refWords;
+    for (const IndexedTU &tu : indexed) {
+      uint32_t entry[TUWords] = {fileIds[tu.file], (uint32_t)depWords.size(), (uint32_t)tu.deps.size(), (uint32_t)refWords.size(), 0, tu.cost};
+      for (auto &dep : tu.deps) {
+        depWords.push_back(fileIds[dep.first]);
+      }
+      std::set<unsigned> tuRecords;
+      for (const IndexedCall &call : tu.calls) {
+        tuRecords.insert(recordIds[RecordKey(call.term, fileIds[call.file], call.line, call.kind)]);
+      }
+      refWords.insert(refWords.end(), tuRecords.begin(), tuRecords.end());
+      entry[4] = tuRecords.size();
+      tuWords.insert(tuWords.end(), entry, entry+TUWords);
+    }
+    uint32_t header[HeaderWords] = {0, Version, (uint32_t)(termWords.size()/TermWords), (uint32_t)fileIds.size(), (uint32_t)(recordWords.size()/RecordWords),
+                                    (uint32_t)indexed.size(), (uint32_t)depWords.size(), (uint32_t)refWords.size(), (uint32_t)pool.size(), 0};
+    memcpy(header, Magic(), 4);
+    std::string contents((const char*)header, sizeof(header));
+    for (const std::vector<uint32_t> *section : {&termWords, &fileWords, &recordWords, &tuWords, &depWords, &refWords}) {
+      contents.append((const char*)section->data(), section->size()*4);
+    }
+    contents += pool;
+    return writeFileAtomically(path, contents);
+  }
+};
+
+//records the calls to config functions of a translation unit, and the files it reads
+class IndexASTConsumer : public ASTConsumer {
+public:
+  IndexASTConsumer(IndexedTU *r) : result(r), handler(&stats), Visitor(&handler, NULL) { Visitor.setIndexSink(&result->calls); }
+
+  void HandleTranslationUnit(ASTContext &Context) override {
+    SourceManager &SM = Context.getSourceManager();
+    handler.setContext(&Context);
+    Visitor.setSourceMgr(SM);
+    for (Decl *D : Context.getTranslationUnitDecl()->decls()) {
+      if (!SM.isInSystemHeader(D->getLocation())) {
+        Visitor.TraverseDecl(D);
+      }
+    }
+    if (const FileEntry *mainEntry = SM.getFileEntryForID(SM.getMainFileID())) {
+      result->file = getCanonicalPath(mainEntry->getName());
+    }
+    std::set<const FileEntry*> seen;
+    for (unsigned i = 0; i < SM.local_sloc_entry_size(); ++i) {
+      const SrcMgr::SLocEntry &entry = SM.getLocalSLocEntry(i);
+      if (!entry.isFile() || entry.getFile().getFileCharacteristic()!=SrcMgr::C_User) continue;
+      const SrcMgr::ContentCache *cache = entry.getFile().getContentCache();
+      if (cache->OrigEntry==NULL || !seen.insert(cache->OrigEntry).second) continue;
+      if (const llvm::MemoryBuffer *buffer = cache->getRawBuffer()) {
+        result->deps.push_back(std::make_pair(getCanonicalPath(cache->OrigEntry->getName()), hashContents(buffer->getBuffer())));
+      }
+    }
+  }
+
+private:
+  IndexedTU *result;
+  //not reported, the index has its own cost measure
+  TUStats stats;
+  MatchHandler handler;
+  ConfigSiteVisitor Visitor;
+};
+
+class IndexFrontendAction : public ASTFrontendAction {
+public:
+  IndexFrontendAction(std::vector<IndexedTU> *r) : results(r) {}
+
+  bool BeginSourceFileAction(CompilerInstance &CI) override {
+    start = std::chrono::steady_clock::now();
+    return true;
+  }
+
+  void EndSourceFileAction() override {
+    result.cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now()-start).count();
+    if (!result.file.empty()) {
+      results->push_back(std::move(result));
+    }
+  }
+
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, StringRef file) override {
+    return llvm::make_unique<IndexASTConsumer>(&result);
+  }
+
+private:
+  std::vector<IndexedTU> *results;
+  IndexedTU result;
+  std::chrono::steady_clock::time_point start;
+};
+
+class IndexFrontendActionFactory : public FrontendActionFactory {
+public:
+  IndexFrontendActionFactory(std::vector<IndexedTU> *r) : results(r) {}
+  FrontendAction *create() override { return new IndexFrontendAction(results); }
+private:
+  std::vector<IndexedTU> *results;
+};
+
+//fill Terms from --term/--value and --terms-file
+static bool loadTerms() {
+  if (!TermName.getValue().empty()) {
+    Terms.add(TermName.getValue(), TermValue.getValue());
+  }
+  if (!TermsFile.getValue().empty()) {
+    std::string error;
+    if (!Terms.loadFromFile(TermsFile.getValue(), error)) {
+      llvm::errs() << "Error reading terms file: " << error << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+static const char *getUseCaseName(ParentType type) {
+  switch (type) {
+    case ParentIf:            return "if";
+    case ParentCE:            return "conditional";
+    case ParentAssignmentRHS: return "assignment";
+    case ParentVarDecl:       return "vardecl";
+    case ParentNonSpecial:    return "other";
+    default:                  return "unknown";
+  }
+}
+
+//xml subcommand: removes the <value name="term" ...> elements of the terms (with everything inside them) from XML config files. Each file is
+//mapped by MemoryBuffer and scanned once for all the terms, and every byte outside the removed elements is kept as it was; an element alone
+//in its lines takes the lines with it. Comments, CDATA sections, processing instructions and declarations are skipped, and nested <value>
+//elements are counted to find the end of each one. As in the refactoring mode, files are overwritten (atomically) only with --overwrite
+class XMLConfigEditor {
+  const TermTable *terms;
+  //terms found in the files edited so far
+  llvm::StringSet<> found;
+
+  //position after the markup starting at pos (a tag, a comment...), or npos if it is not closed
+  static size_t skipMarkup(StringRef text, size_t pos) {
+    static const char *delimited[][2] = {{"<!--", "-->"}, {"<![CDATA[", "]]>"}, {"<?", "?>"}};
+    for (auto &d : delimited) {
+      if (text.substr(pos).startswith(d[0])) {
+        size_t end = text.find(d[1], pos+strlen(d[0]));
+        return end==StringRef::npos ? end : end+strlen(d[1]);
+      }
+    }
+    //quoted attribute values may have '>' in them, and so may the internal subset of a <!DOCTYPE>
+    char quote = 0;
+    int brackets = 0;
+    for (size_t i = pos+1; i < text.size(); ++i) {
+      char c = text[i];
+      if (quote!=0) {
+        if (c==quote) quote = 0;
+      } else if (c=='"' || c=='\'') {
+        quote = c;
+      } else if (c=='[') {
+        ++brackets;
+      } else if (c==']') {
+        --brackets;
+      } else if (c=='>' && brackets<=0) {
+        return i+1;
+      }
+    }
+    return StringRef::npos;
+  }
+
+  //name of the element of a start or end tag
+  static StringRef getTagName(StringRef tag) {
+    return tag.drop_front(tag.startswith("</") ? 2 : 1).take_until([](char c) { return isspace((unsigned char)c) || c=='/' || c=='>'; });
+  }
+
+  //attribute values as an XPath query sees them: the predefined entities and ASCII character references are decoded
+  static std::string decodeEntities(StringRef value) {
+    std::string decoded;
+    size_t amp;
+    while ((amp = value.find('&')) != StringRef::npos) {
+      decoded += value.substr(0, amp);
+      value = value.substr(amp);
+      size_t semi = value.find(';');
+      if (semi==StringRef::npos) break;
+      StringRef entity = value.slice(1, semi);
+      unsigned code;
+      if (entity=="amp") decoded += '&';
+      else if (entity=="lt") decoded += '<';
+      else if (entity=="gt") decoded += '>';
+      else if (entity=="quot") decoded += '"';
+      else if (entity=="apos") decoded += '\'';
+      else if (entity.startswith("#x") && !entity.drop_front(2).getAsInteger(16, code) && code<0x80) decoded += (char)code;
+      else if (entity.startswith("#") && !entity.drop_front(1).getAsInteger(10, code) && code<0x80) decoded += (char)code;
+      else decoded += value.slice(0, semi+1);
+      value = value.substr(semi+1);
+    }
+    decoded += value;
+    return decoded;
+  }
+
+  //the range of an element, extended to its whole lines if there is nothing else in them
+  static std::pair<size_t, size_t> getRemovedRange(StringRef text, size_t start, size_t end) {
+    size_t lineStart = start, lineEnd = end;
+    while (lineStart>0 && isWhitespaceExceptNL(text[lineStart-1])) --lineStart;
+    while (lineEnd<text.size() && isWhitespaceExceptNL(text[lineEnd])) ++lineEnd;
+    if ((lineStart==0 || text[lineStart-1]=='\n') && (lineEnd==text.size() || text[lineEnd]=='\n')) {
+      return std::make_pair(lineStart, std::min(lineEnd+1, text.size()));
+    }
+    return std::make_pair(start, end);
+  }
+
+  //the ranges to remove, in order
+  bool findElements(StringRef text, std::vector<std::pair<size_t, size_t>> &ranges, std::string &error) {
+    size_t pos = 0;
+    //start of the element being removed, and how many <value> elements inside it are open
+    size_t removing = StringRef::npos;
+    unsigned depth = 0;
+    while ((pos = text.find('<', pos)) != StringRef::npos) {
+      size_t end = skipMarkup(text, pos);
+      if (end==StringRef::npos) {
+        error = "unterminated markup at offset " + std::to_string(pos);
+        return false;
+      }
+      StringRef tag = text.slice(pos, end);
+      if (getTagName(tag)=="value") {
+        bool closing = tag.startswith("</"), empty = tag.endswith("/>");
+        if (removing!=StringRef::npos) {
+          if (closing && depth==0) {
+            ranges.push_back(getRemovedRange(text, removing, end));
+            removing = StringRef::npos;
+          } else if (closing) {
+            --depth;
+          } else if (!empty) {
+            ++depth;
+          }
+        } else if (!closing) {
+          StringRef name;
+          std::string term = getXMLAttribute(tag.drop_back(empty ? 2 : 1), "name", name) ? decodeEntities(name) : std::string();
+          if (!term.empty() && terms->contains(term)) {
+            found.insert(term);
+            if (empty) {
+              ranges.push_back(getRemovedRange(text, pos, end));
+            } else {
+              removing = pos;
+              depth = 0;
+            }
+          }
+        }
+      }
+      pos = end;
+    }
+    if (removing!=StringRef::npos) {
+      error = "unclosed <value> element at offset " + std::to_string(removing);
+      return false;
+    }
+    return true;
+  }
+
+public:
+  XMLConfigEditor(const TermTable *t) : terms(t) {}
+
+  //remove the elements of the terms from the file, and write it (or print it, if not overwriting). False on errors
+  bool editFile(StringRef path, bool overwrite, unsigned &removed) {
+    auto buffer = llvm::MemoryBuffer::getFile(path, -1, /*RequiresNullTerminator=*/false);
+    if (!buffer) {
+      llvm::errs() << "Cannot read " << path << ": " << buffer.getError().message() << "\n";
+      return false;
+    }
+    StringRef text = (*buffer)->getBuffer();
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::string error;
+    if (!findElements(text, ranges, error)) {
+      llvm::errs() << "Cannot edit " << path << ": " << error << "\n";
+      return false;
+    }
+    removed = ranges.size();
+    auto write = [&](raw_ostream &out) {
+      size_t pos = 0;
+      for (auto &r : ranges) {
+        out << text.slice(pos, r.first);
+        pos = r.second;
+      }
+      out << text.substr(pos);
+    };
+    if (!overwrite) {
+      write(llvm::outs());
+      return true;
+    }
+    //files without edits are never written
+    return ranges.empty() || writeFileAtomically(path, write);
+  }
+
+  std::vector<std::string> getMissingTerms() const {
+    std::vector<std::string> missing;
+    for (const std::string &term : terms->getTerms()) {
+      if (!found.count(term)) missing.push_back(term);
+    }
+    return missing;
+  }
+};
+
+//xml subcommand, with the options already parsed
+static int runXMLEdit() {
+  if (!loadTerms()) {
+    return 1;
+  }
+  if (Terms.size()==0) {
+    llvm::errs() << "No terms to remove: use either --term or --terms-file\n";
+    return 1;
+  }
+  XMLConfigEditor editor(&Terms);
+  int status = 0;
+  for (const std::string &path : XMLFiles) {
+    unsigned removed;
+    if (!editor.editFile(path, Overwrite.getValue(), removed)) {
+      status = 1;
+      continue;
+    }
+    llvm::errs() << "XML: " << removed << " entries removed from " << path << "\n";
+  }
+  for (const std::string &term : editor.getMissingTerms()) {
+    llvm::errs() << "WARNING: no entry for " << term << " in the XML files\n";
+  }
+  return status;
+}
+
+//index subcommand: index the calls to config functions of the given translation units (or all the ones in the compilation database) in
+//--index-file. If the file already exists, the translation units whose files have the same contents as when they were indexed are not parsed again
+static int runIndex(const CompilationDatabase &Compilations, const std::vector<std::string> &sources) {
+  if (IndexFile.getValue().empty()) {
+    llvm::errs() << "The index subcommand needs --index-file\n";
+    return 1;
+  }
+  CallSiteIndex index;
+  std::string error;
+  bool exists = llvm::sys::fs::exists(IndexFile.getValue());
+  if (exists && !index.load(IndexFile.getValue(), error)) {
+    llvm::errs() << "Cannot use the existing index (" << error << "), rebuilding it\n";
+    exists = false;
+  }
+  if (!Query.getValue().empty()) {
+    if (!exists) {
+      llvm::errs() << "Cannot query " << IndexFile.getValue() << ": " << error << "\n";
+      return 1;
+    }
+    std::vector<IndexedCall> calls;
+    index.getCalls(Query.getValue(), calls);
+    for (const IndexedCall &call : calls) {
+      llvm::outs() << call.file << ":" << call.line << ": " << getUseCaseName(call.kind) << "\n";
+    }
+    return 0;
+  }
+
+  std::vector<std::string> files;
+  for (const std::string &path : sources.empty() ? Compilations.getAllFiles() : sources) {
+    files.push_back(getCanonicalPath(path));
+  }
+  std::vector<IndexedTU> previous;
+  if (exists) {
+    previous = index.getTUs();
+  }
+  llvm::StringMap<size_t> previousByFile;
+  for (size_t i = 0; i < previous.size(); ++i) {
+    previousByFile[previous[i].file] = i;
+  }
+  //hashes of the files on disk, shared by all the translation units
+  llvm::StringMap<uint64_t> hashes;
+  auto unchanged = [&](const IndexedTU &tu) {
+    for (auto &dep : tu.deps) {
+      auto it = hashes.find(dep.first);
+      if (it==hashes.end()) {
+        auto buffer = llvm::MemoryBuffer::getFile(dep.first);
+        it = hashes.insert(std::make_pair(dep.first, buffer ? hashContents((*buffer)->getBuffer()) : 0)).first;
+      }
+      if (it->second!=dep.second) return false;
+    }
+    return true;
+  };
+  std::vector<IndexedTU> indexed;
+  std::vector<std::string> toIndex;
+  llvm::StringSet<> listed;
+  for (const std::string &file : files) {
+    listed.insert(file);
+    auto it = previousByFile.find(file);
+    if (it!=previousByFile.end() && unchanged(previous[it->second])) {
+      indexed.push_back(std::move(previous[it->second]));
+    } else {
+      toIndex.push_back(file);
+    }
+  }
+  size_t numUnchanged = indexed.size();
+  //when indexing some translation units, the others are kept
+  if (!sources.empty()) {
+    for (IndexedTU &tu : previous) {
+      if (!listed.count(tu.file)) {
+        indexed.push_back(std::move(tu));
+      }
+    }
+  }
+  int status = 0;
+  if (!toIndex.empty()) {
+    ClangTool Tool(Compilations, toIndex);
+    IndexFrontendActionFactory factory(&indexed);
+    status = Tool.run(&factory);
+  }
+  if (!CallSiteIndex::write(IndexFile.getValue(), indexed)) {
+    return 1;
+  }
+  size_t numCalls = 0;
+  for (const IndexedTU &tu : indexed) {
+    numCalls += tu.calls.size();
+  }
+  llvm::errs() << "Index: " << indexed.size() << " translation units (" << toIndex.size() << " parsed, " << numUnchanged << " unchanged), " << numCalls << " calls\n";
+  return status;
+}
+
+//--daemon: the translation units are kept in memory as ASTUnits, with a precompiled preamble for the #included headers, and refactoring
+//requests are answered with their merged edits, without writing anything. Requests are lines from the standard input (or from each
+//connection to --socket):
+//   refactor term=value [term=value ...]   answered with a YAML document in the --export-edits format
+//   stats                                  answered with a line about the cached translation units
+//   quit                                   stops the daemon
+//A translation unit is parsed the first time a request needs it (the prefilter is applied to each request), parsed again if any of its
+//files has changed on disk, and evicted in least recently used order when the cache goes over --cache-mb. Requests are served one at a time
+class RefactorDaemon {
+  //a file read by a translation unit, as it was when the translation unit was parsed
+  struct Stamp {
+    std::string path;
+    time_t mtime;
+    uint64_t size, hash;
+  };
+
+  struct CachedUnit {
+    std::unique_ptr<ASTUnit> unit;
+    std::vector<Stamp> stamps;
+    size_t memory;
+    std::list<std::string>::iterator lru;
+  };
+
+  const CompilationDatabase &Compilations;
+  std::vector<std::string> files;
+  std::string resourcesPath;
+  std::shared_ptr<PCHContainerOperations> PCHContainerOps;
+  llvm::StringMap<CachedUnit> cache;
+  //most recently used first
+  std::list<std::string> lru;
+  size_t cacheLimit, cacheSize;
+  unsigned numParses, numReparses, numEvictions;
+
+  //same as clang_getCXTUResourceUsage(), without the preamble (which is kept on disk)
+  static size_t getMemory(ASTUnit &unit) {
+    ASTContext &ctx = unit.getASTContext();
+    SourceManager::MemoryBufferSizes buffers = unit.getSourceManager().getMemoryBufferSizes();
+    return ctx.getASTAllocatedMemory() + ctx.getSideTableAllocatedMemory() + unit.getSourceManager().getDataStructureSizes() + buffers.malloc_bytes + buffers.mmap_bytes;
+  }
+
+  //hash of the contents of a file on disk (0 if it cannot be read), each file read just once per request
+  static uint64_t getHash(const std::string &path, llvm::StringMap<uint64_t> &hashes) {
+    auto it = hashes.find(path);
+    if (it==hashes.end()) {
+      auto buffer = llvm::MemoryBuffer::getFile(path, -1, /*RequiresNullTerminator=*/false);
+      it = hashes.insert(std::make_pair(path, buffer ? hashContents((*buffer)->getBuffer()) : 0)).first;
+    }
+    return it->second;
+  }
+
+  static void getStamps(ASTUnit &unit, std::vector<Stamp> &stamps, llvm::StringMap<uint64_t> &hashes) {
+    SmallVector<const FileEntry*, 256> entries;
+    unit.getFileManager().GetUniqueIDMapping(entries);
+    stamps.clear();
+    for (const FileEntry *entry : entries) {
+      if (entry!=NULL) {
+        Stamp stamp;
+        stamp.path = entry->getName().str();
+        stamp.mtime = entry->getModificationTime();
+        stamp.size = entry->getSize();
+        stamp.hash = getHash(stamp.path, hashes);
+        stamps.push_back(stamp);
+      }
+    }
+  }
+
+  //a file rewritten within the same second, or restored with its old modification time (as git checkout may do), only shows in its contents
+  static bool hasChanged(const CachedUnit &cu, llvm::StringMap<uint64_t> &hashes) {
+    for (const Stamp &stamp : cu.stamps) {
+      llvm::sys::fs::file_status status;
+      if (llvm::sys::fs::status(stamp.path, status) || llvm::sys::toTimeT(status.getLastModificationTime())!=stamp.mtime ||
+          status.getSize()!=stamp.size || getHash(stamp.path, hashes)!=stamp.hash) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void updateCached(CachedUnit &cu, llvm::StringMap<uint64_t> &hashes) {
+    getStamps(*cu.unit, cu.stamps, hashes);
+    cacheSize -= cu.memory;
+    cu.memory = getMemory(*cu.unit);
+    cacheSize += cu.memory;
+  }
+
+  //evict least recently used translation units until the cache fits in the limit, but never the one in use
+  void evict() {
+    while (cacheSize>cacheLimit && lru.size()>1) {
+      auto victim = cache.find(lru.back());
+      cacheSize -= victim->second.memory;
+      cache.erase(victim);
+      lru.pop_back();
+      ++numEvictions;
+    }
+  }
+
+  //the parsed translation unit, up to date with the files on disk, or NULL if it cannot be parsed. The hashes of the files are shared
+  //by all the translation units of a request
+  ASTUnit *getUnit(const std::string &file, const CompileCommand &command, llvm::StringMap<uint64_t> &hashes) {
+    auto it = cache.find(file);
+    if (it!=cache.end()) {
+      CachedUnit &cu = it->second;
+      lru.erase(cu.lru);
+      lru.push_front(file);
+      cu.lru = lru.begin();
+      if (!hasChanged(cu, hashes)) {
+        return cu.unit.get();
+      }
+      //the preamble is reused if the #included headers have not changed
+      if (!cu.unit->Reparse(PCHContainerOps)) {
+        ++numReparses;
+        //the files may have changed again since they were hashed
+        hashes.clear();
+        updateCached(cu, hashes);
+        return cu.unit.get();
+      }
+      llvm::errs() << "Cannot reparse " << file << ", parsing it from scratch\n";
+      cacheSize -= cu.memory;
+      lru.erase(cu.lru);
+      cache.erase(it);
+    }
+    CommandLineArguments args = getClangSyntaxOnlyAdjuster()(command.CommandLine, file);
+    args = getClangStripOutputAdjuster()(args, file);
+    args = getClangStripDependencyFileAdjuster()(args, file);
+    std::vector<const char*> argv;
+    for (const std::string &arg : args) {
+      argv.push_back(arg.c_str());
+    }
+    IntrusiveRefCntPtr<DiagnosticsEngine> Diags = CompilerInstance::createDiagnostics(new DiagnosticOptions());
+    std::unique_ptr<ASTUnit> unit(ASTUnit::LoadFromCommandLine(argv.data(), argv.data()+argv.size(), PCHContainerOps, Diags, resourcesPath,
+                                                               /*OnlyLocalDecls=*/false, /*CaptureDiagnostics=*/false, None,
+                                                               /*RemappedFilesKeepOriginalName=*/true, /*PrecompilePreambleAfterNParses=*/1));
+    if (!unit) {
+      llvm::errs() << "Cannot parse " << file << "\n";
+      return NULL;
+    }
+    ++numParses;
+    CachedUnit &cu = cache[file];
+    cu.unit = std::move(unit);
+    cu.memory = 0;
+    lru.push_front(file);
+    cu.lru = lru.begin();
+    hashes.clear();
+    updateCached(cu, hashes);
+    return cu.unit.get();
+  }
+
+  void refactor(StringRef request, raw_ostream &out) {
+    //its own table, not the global Terms of the other modes
+    TermTable terms;
+    SmallVector<StringRef, 16> termValues;
+    request.split(termValues, ' ', -1, false);
+    for (StringRef tv : termValues) {
+      std::pair<StringRef, StringRef> split = tv.split('=');
+      bool value;
+      if (split.first.empty() || !parseBoolValue(split.second, value)) {
+        out << "error: invalid term=value <" << tv << ">\n";
+        return;
+      }
+      terms.add(split.first, value);
+    }
+    if (terms.size()==0) {
+      out << "error: no terms to refactor\n";
+      return;
+    }
+    //restored after the request, so that it does not depend on the translation units of the previous one
+    SmallString<256> previousDir;
+    if (std::error_code EC = llvm::sys::fs::current_path(previousDir)) {
+      out << "error: cannot get the working directory: " << EC.message() << "\n";
+      return;
+    }
+    TermPrefilter prefilter(&terms);
+    EditMerger merger;
+    llvm::StringMap<uint64_t> hashes;
+    for (const std::string &file : files) {
+      std::vector<CompileCommand> commands = Compilations.getCompileCommands(file);
+      if (commands.empty()) continue;
+      if (Prefilter.getValue() && !prefilter.mayContainTerms(commands[0], file)) continue;
+      //as in ClangTool::run(), relative paths in the compile command are relative to its directory
+      if (::chdir(commands[0].Directory.c_str())!=0) {
+        llvm::errs() << "Cannot change to directory " << commands[0].Directory << "\n";
+        continue;
+      }
+      ASTUnit *unit = getUnit(file, commands[0], hashes);
+      if (unit==NULL) continue;
+      EditCollector edits;
+      RefactorEngine refactorTool;
+      edits.setSourceMgr(unit->getSourceManager(), unit->getLangOpts());
+      refactorTool.setEditCollector(&edits);
+      TUStats stats;
+      MyASTConsumer consumer(&refactorTool, &terms, &stats);
+      consumer.HandleTranslationUnit(unit->getASTContext());
+      std::vector<FileEdits> fileEdits;
+      edits.getFileEdits(fileEdits);
+      for (const FileEdits &fe : fileEdits) {
+        merger.add(fe, file);
+      }
+      evict();
+    }
+    if (::chdir(previousDir.c_str())!=0) {
+      llvm::errs() << "Cannot change back to directory " << previousDir << "\n";
+    }
+    std::vector<FileEdits> fileEdits = merger.getFileEdits();
+    llvm::yaml::Output yout(out);
+    yout << fileEdits;
+  }
+
+public:
+  RefactorDaemon(const CompilationDatabase &c, const std::vector<std::string> &f, StringRef resources, size_t limit)
+    : Compilations(c), files(f), resourcesPath(resources), PCHContainerOps(std::make_shared<PCHContainerOperations>()),
+      cacheLimit(limit), cacheSize(0), numParses(0), numReparses(0), numEvictions(0) {}
+
+  //answer the requests read from fd, until the end of the input or a quit request (then, it returns false)
+  bool serve(int fd, raw_ostream &out) {
+    std::string buffer;
+    char chunk[4096];
+    while (true) {
+      size_t eol = buffer.find('\n');
+      if (eol==std::string::npos) {
+        ssize_t n = ::read(fd, chunk, sizeof(chunk));
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) return true;
+        buffer.append(chunk, n);
+        continue;
+      }
+      StringRef line = StringRef(buffer).substr(0, eol).trim();
+      StringRef command, rest;
+      std::tie(command, rest) = line.split(' ');
+      if (command=="quit") {
+        return false;
+      } else if (command=="refactor") {
+        refactor(rest.trim(), out);
+      } else if (command=="stats") {
+        out << "units: " << cache.size() << ", memory: " << (cacheSize>>20) << " MB, parses: " << numParses << ", reparses: " << numReparses << ", evictions: " << numEvictions << "\n";
+      } else if (!command.empty()) {
+        out << "error: unknown request <" << command << ">\n";
+      }
+      out.flush();
+      buffer.erase(0, eol+1);
+    }
+  }
+
+  //serve each connection to a Unix socket in turn, until a quit request
+  int listen(StringRef path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size()>=sizeof(addr.sun_path)) {
+      llvm::errs() << "Socket path too long: " << path << "\n";
+      return 1;
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    int sock = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(addr.sun_path);
+    if (sock<0 || ::bind(sock, (sockaddr*)&addr, sizeof(addr))!=0 || ::listen(sock, 4)!=0) {
+      llvm::errs() << "Cannot listen on " << path << ": " << strerror(errno) << "\n";
+      return 1;
+    }
+    bool keepServing = true;
+    while (keepServing) {
+      int conn = ::accept(sock, NULL, NULL);
+      if (conn<0) {
+        if (errno==EINTR) continue;
+        llvm::errs() << "Cannot accept connections on " << path << ": " << strerror(errno) << "\n";
+        break;
+      }
+      {
+        llvm::raw_fd_ostream out(conn, /*shouldClose=*/false);
+        keepServing = serve(conn, out);
+      }
+      ::close(conn);
+    }
+    ::close(sock);
+    ::unlink(addr.sun_path);
+    return keepServing ? 1 : 0;
+  }
+};
+
+int main(int argc, const char **argv) {
+  //the xml subcommand is a cl::SubCommand. The index subcommand takes the same options and translation units as the refactoring mode (and
+  //CommonOptionsParser only knows about the top level ones), so it is just taken out of the command line
+  if (argc>1 && StringRef(argv[1])=="xml") {
+    llvm::cl::HideUnrelatedOptions(CustomOptions, XMLCommand);
+    llvm::cl::ParseCommandLineOptions(argc, argv);
+    return runXMLEdit();
+  }
+  bool indexMode = argc>1 && StringRef(argv[1])=="index";
+  if (indexMode) {
+    argv[1] = argv[0];
+    ++argv;
+    --argc;
+  }
+  StatsClock::time_point runStart = StatsClock::now();
+  CommonOptionsParser op(argc, argv, CustomOptions, llvm::cl::ZeroOrMore);
+  if (indexMode) {
+    return runIndex(op.getCompilations(), op.getSourcePathList());
+  }
+  if (Daemon.getValue()) {
+    std::vector<std::string> files;
+    for (const std::string &path : op.getSourcePathList()) {
+      files.push_back(getAbsolutePath(path));
+    }
+    //any function in this executable will do to locate the clang resource directory
+    std::string resources = CompilerInvocation::GetResourcesPath(argv[0], (void*)(intptr_t)getCanonicalPath);
+    RefactorDaemon daemon(op.getCompilations(), files, resources, (size_t)CacheMB.getValue()<<20);
+    if (!SocketPath.getValue().empty()) {
+      //the working directory changes with each translation unit
+      return daemon.listen(getAbsolutePath(SocketPath.getValue()));
+    }
+    daemon.serve(STDIN_FILENO, llvm::outs());
+    return 0;
+  }
+  //the workers leave the working directory of the last translation unit, so the files named in the options are resolved before them
+  if (!ExportEdits.getValue().empty()) {
+    ExportEdits.setValue(getAbsolutePath(ExportEdits.getValue()));
+  }
+  if (!Stats.getValue().empty()) {
+    Stats.setValue(getAbsolutePath(Stats.getValue()));
+  }
+  std::vector<std::string> applyPaths;
+  for (const std::string &yamlPath : ApplyEdits) {
+    applyPaths.push_back(getAbsolutePath(yamlPath));
+  }
+  EditMerger merger;
+  for (const std::string &yamlPath : applyPaths) {
+    if (!merger.addFromYAML(yamlPath)) {
+      return 1;
+    }
+  }
+  int status = 0;
+  std::vector<TUStats> tuStats;
+
+  if (!loadTerms()) {
+    return 1;
+  }
+  std::vector<std::string> sources = op.getSourcePathList();
+  bool fromIndex = sources.empty() && !IndexFile.getValue().empty() && Terms.size()>0;
+  if (fromIndex) {
+    CallSiteIndex index;
+    std::string error;
+    if (!index.load(IndexFile.getValue(), error)) {
+      llvm::errs() << "Error reading index: " << error << "\n";
+      return 1;
+    }
+    sources = index.getTUsForTerms(Terms);
+    llvm::errs() << "Index: " << sources.size() << " translation units reach all the calls for the terms\n";
+  }
+
+  if (!sources.empty()) {
+    if (Terms.size()==0) {
+      llvm::errs() << "No terms to refactor: use either --term and --value, or --terms-file\n";
+      return 1;
+    }
+
+    //the working directory is changed by each ClangTool run, so paths have to be made absolute before any worker starts
+    std::vector<std::string> files;
+    std::set<std::string> directories;
+    for (const std::string &path : sources) {
+      files.push_back(getAbsolutePath(path));
+      for (const CompileCommand &command : op.getCompilations().getCompileCommands(files.back())) {
+        directories.insert(command.Directory);
+      }
+    }
+    WorkerOptions options;
+    options.jobs = Jobs.getValue()==0 ? std::max(1u, std::thread::hardware_concurrency()) : Jobs.getValue();
+    if (options.jobs>1 && directories.size()>1) {
+      llvm::errs() << "WARNING: the compile commands use several working directories, and chdir is process-wide, so translation units are processed one at a time\n";
+      options.jobs = 1;
+    }
+    options.jobs = std::min<size_t>(options.jobs, files.size());
+    options.mergeEdits = Overwrite.getValue() || !ExportEdits.getValue().empty() || !ApplyEdits.empty();
+    options.output = Output.getValue();
+    options.prefilter = Prefilter.getValue();
+    if (!Stats.getValue().empty()) {
+      options.stats = &tuStats;
+    }
+    std::unique_ptr<SharedPCH> pch;
+    if (!PCHCache.getValue().empty()) {
+      //translation units skipped by the prefilter do not need the precompiled headers
+      std::vector<std::string> parsed;
+      TermPrefilter prefilter(&Terms);
+      for (const std::string &file : files) {
+        std::vector<CompileCommand> commands = op.getCompilations().getCompileCommands(file);
+        if (!options.prefilter || commands.empty() || prefilter.mayContainTerms(commands[0], file)) {
+          parsed.push_back(file);
+        }
+      }
+      pch.reset(new SharedPCH(PCHCache.getValue(), PCHIncludes.getValue(), CompilerInvocation::GetResourcesPath(argv[0], (void*)(intptr_t)getCanonicalPath)));
+      pch->prepare(op.getCompilations(), parsed);
+      options.pch = pch.get();
+    }
+
+    if (FixedPoint.getValue()) {
+      status = runFixedPoint(op.getCompilations(), files, options, merger);
+    } else {
+      status = runWorkers(op.getCompilations(), files, options, merger);
+    }
+  } else if (ApplyEdits.empty() && !fromIndex) {
+    llvm::errs() << "Nothing to do: give source files to refactor and/or --apply-edits\n";
+    return 1;
+  }
+
+  StatsClock::time_point writeStart = StatsClock::now();
+  if (!ExportEdits.getValue().empty()) {
+    if (!merger.exportYAML(ExportEdits.getValue())) {
+      status = 1;
+    }
+  } else if (Overwrite.getValue() || !ApplyEdits.empty()) {
+    if (!merger.writeFiles()) {
+      status = 1;
+    }
+  }
+  double writeMs = msSince(writeStart);
+  if (merger.conflicts()>0) {
+    status = std::max(status, 1);
+  }
+  if (!Stats.getValue().empty() && !writeStats(Stats.getValue(), tuStats, msSince(runStart), writeMs, merger.conflicts())) {
+    status = std::max(status, 1);
+  }
+  return status;
 }